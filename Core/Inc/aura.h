@@ -3,6 +3,26 @@
 
 #include "stm32f4xx.h"
 #define DELAY
+// Ответы из send_fifos идут по USART1 подряд, без пауз между посылками
+#define AURA_TX_BURST
+// Скорость USART1 определяется по первому байту 'A' посылки мастера и
+// переопределяется после AURA_AUTOBAUD_ERRORS ошибок приема подряд
+#define AURA_AUTOBAUD
+#define AURA_AUTOBAUD_ERRORS 8
+// Посылка мастера уходит в порт назначения по мере приема, не дожидаясь CRC;
+// при неверной CRC передача обрывается
+#define AURA_CUT_THROUGH
+// Несколько ответов из очередей уходят мастеру одной посылкой
+// CMD_ANS_CONTAINER, если мастер их включил (CHUNK_ID_CONTAINER_MTU);
+// одиночный ответ ждет попутчиков не дольше AURA_COALESCE_MS
+#define AURA_CONTAINER
+#define AURA_COALESCE_MS 5
+// На линиях между своими расширителями посылки могут закрываться
+// аппаратной CRC32 вместо CRC16; порты выбирает мастер, по умолчанию CRC16
+#define AURA_CRC32
+// Короткий заголовок v2 на линии с мастером: varint-поля и однобайтовые
+// адреса, выданные расширителем. Включает мастер, v1 принимается всегда
+#define AURA_V2
 
 void aura_init(void);
 void aura_process(void);
@@ -0,0 +1,13 @@
+#ifndef __AUTOBAUD_H__
+#define __AUTOBAUD_H__
+
+#include "stm32f4xx.h"
+
+void autobaud_start(void);
+uint32_t autobaud_is_running(void);
+
+void tim1_cc3_callback(uint16_t capture);
+
+void autobaud_complete_callback(uint32_t baudrate);
+
+#endif
@@ -31,6 +31,35 @@ enum chunk_id {
     CHUNK_ID_RELAY1_STATUS = 4,
     CHUNK_ID_RELAY2_STATUS = 5,
     CHUNK_ID_BAT_VOLT = 6,
+    CHUNK_ID_UART_IRQ_COUNT = 7,
+    CHUNK_ID_UART_IRQ_CYCLES = 8,
+    CHUNK_ID_UART_CFG = 9,
+    CHUNK_ID_AUTOBAUD = 10,
+    CHUNK_ID_AURA_STAT = 11,
+    CHUNK_ID_PORT_STAT = 12,
+    CHUNK_ID_SCHED_WEIGHTS = 13,
+    CHUNK_ID_SCHED_HOL_MS = 14,
+    CHUNK_ID_SEND_POLICY = 15,
+    CHUNK_ID_SEND_DROP = 16,
+    CHUNK_ID_BUSY = 17,
+    CHUNK_ID_ROUTE_AGE = 18,
+    CHUNK_ID_WHOAMI_CACHE = 19,
+    CHUNK_ID_SRC_ROUTE = 20,
+    CHUNK_ID_DUP_SUPPRESSED = 21,
+    CHUNK_ID_GATHER_CMD = 22,
+    CHUNK_ID_GATHER_MS = 23,
+    CHUNK_ID_GATHER_DEV = 24,
+    CHUNK_ID_GATHER_END = 25,
+    CHUNK_ID_FRAME = 26,
+    CHUNK_ID_COALESCE_MS = 27,
+    CHUNK_ID_BULK_REQ = 28,
+    CHUNK_ID_POLL = 29,
+    CHUNK_ID_POLL_TTL_MS = 30,
+    CHUNK_ID_POLL_AGE_MS = 31,
+    CHUNK_ID_FRAME_CRC32 = 32,
+    CHUNK_ID_FRAME_V2 = 33,
+    CHUNK_ID_LINK_ADDRS = 34,
+    CHUNK_ID_CONTAINER_MTU = 35,
 };
 
 struct chunk_hdr {
@@ -59,6 +88,49 @@ struct chunk_u32arr {
     uint32_t arr[];
 };
 
+// Настройка порта: port - номер uart, parity: 0 - нет, 1 - even, 2 - odd
+struct chunk_uart_cfg {
+    struct chunk_hdr hdr;
+    uint8_t port;
+    uint8_t parity;
+    uint8_t stop_bits;
+    uint8_t over8;
+    uint32_t baudrate;
+};
+
+// Маршрут от источника: выходные порты по одному на расширитель,
+// неиспользуемые в конце - 0xFF
+struct chunk_src_route {
+    struct chunk_hdr hdr;
+    uint8_t ports[];
+};
+
+// Ответ одного устройства в сводной посылке: uid и его chunk'и как есть
+struct chunk_gather_dev {
+    struct chunk_hdr hdr;
+    uint32_t uid;
+    uint8_t data[];
+};
+
+// Подзапрос пакетного запроса: uid и cmd устройства, его chunk'и как есть.
+// reserved - 0, выравнивает data на 4 байта
+struct chunk_bulk_req {
+    struct chunk_hdr hdr;
+    uint32_t uid;
+    uint16_t cmd;
+    uint16_t reserved;
+    uint8_t data[];
+};
+
+// Устройство в расписании фонового опроса: uid, команда и период, мс.
+// period_ms 0 - убрать из расписания
+struct chunk_poll {
+    struct chunk_hdr hdr;
+    uint32_t uid;
+    uint16_t cmd;
+    uint16_t period_ms;
+};
+
 struct chunk_f32 {
     struct chunk_hdr hdr;
     float val;
@@ -84,4 +156,17 @@ static void chunk_u32_add(void **next_chunk, enum chunk_id id, uint32_t val)
     *next_chunk = (void *)((uint32_t)*next_chunk + sizeof(*c));
 }
 
+static void chunk_u32arr_add(void **next_chunk, enum chunk_id id,
+                             const uint32_t *arr, uint32_t count)
+{
+    struct chunk_u32arr *c = (struct chunk_u32arr *)*next_chunk;
+    c->hdr.id = id;
+    c->hdr.type = CHUNK_TYPE_ARR_U32;
+    c->hdr.size = count * sizeof(c->arr[0]);
+    for (uint32_t i = 0; i < count; i++) {
+        c->arr[i] = arr[i];
+    }
+    *next_chunk = (void *)((uint32_t)*next_chunk + sizeof(c->hdr) + c->hdr.size);
+}
+
 #endif
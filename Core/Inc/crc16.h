@@ -3,11 +3,24 @@
 
 #include "stm32f4xx.h"
 
+// crc16_bench: такты CPU на расчет по DWT, для замеров на плате
+// #define CRC16_BENCH
+
 typedef uint16_t crc16_t;
 
 crc16_t crc16_calc(const void *buf, uint32_t size);
 crc16_t crc16_calc_continue(crc16_t crc, const void *buf, uint32_t size);
 void crc16_add2pack(void *buf, uint32_t size);
+// crc, записанная в посылке после size байт данных
+crc16_t crc16_get(const void *buf, uint32_t size);
+void crc16_set(void *buf, uint32_t size, crc16_t crc);
+// crc данных длиной size после замены len байт по смещению offset
+// с old на new. Дописанные в конец байты - crc16_calc_continue
+crc16_t crc16_patch(crc16_t crc, uint32_t size, uint32_t offset,
+                    const void *old, const void *new, uint32_t len);
+#ifdef CRC16_BENCH
+uint32_t crc16_bench(const void *buf, uint32_t size);
+#endif
 
 inline static uint32_t crc16_is_valid(const void *buf, uint32_t size)
 {
@@ -0,0 +1,16 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include "stm32f4xx.h"
+
+// crc32_bench: такты блока CRC и crc16 на одну посылку, для замеров на плате
+// #define CRC32_BENCH
+
+typedef uint32_t crc32_t;
+
+void crc32_init(void);
+crc32_t crc32_calc(const void *buf, uint32_t size);
+#ifdef CRC32_BENCH
+void crc32_bench(const void *buf, uint32_t size, uint32_t *cycles32, uint32_t *cycles16);
+#endif
+#endif
@@ -6,9 +6,14 @@
 
 #define sizeof_u32(_val) (sizeof(_val) / sizeof(uint32_t))
 
+// Хеш-таблица с открытой адресацией и линейным пробированием.
+// _count - степень двойки, заполняется не больше чем на 3/4.
+// Ключ 0 - признак пустой ячейки, поэтому 0 ключом быть не может
 #define dict_declare(_name, _count)          \
-    uint32_t _name##_buf[sizeof(struct dict) \
-                         + sizeof(struct keyvalue) * (_count)] = {0}
+    uint32_t _name##_buf[sizeof_u32(struct dict) \
+                         + sizeof_u32(struct keyvalue) * (_count)] = {[1] = (_count)-1}
+
+#define DICT_KEY_EMPTY 0
 
 struct keyvalue {
     uint32_t key;
@@ -17,31 +22,96 @@ struct keyvalue {
 
 struct dict {
     uint32_t count;
+    const uint32_t mask;
     struct keyvalue kvs[];
 };
 
+inline static uint32_t dict_hash(struct dict *d, uint32_t key)
+{
+    uint32_t h = key * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & d->mask;
+}
+
+inline static uint32_t dict_is_full(struct dict *d)
+{
+    return d->count >= ((d->mask + 1) >> 2) * 3;
+}
+
 inline static void dict_clear(struct dict *d)
 {
     if (d->count == 0) {
         return;
     }
-    arr_clear_u32(d->kvs, d->count * sizeof_u32(d->kvs[0]));
+    arr_clear_u32(d->kvs, (d->mask + 1) * sizeof_u32(d->kvs[0]));
     d->count = 0;
 }
 
 inline static uint32_t dict_get_idx(struct dict *p, uint32_t key)
 {
-    for (uint32_t i = 0; i < p->count; i++) {
+    if (key == DICT_KEY_EMPTY) {
+        return -1U;
+    }
+    uint32_t i = dict_hash(p, key);
+    while (p->kvs[i].key != DICT_KEY_EMPTY) {
         if (p->kvs[i].key == key) {
             return i;
         }
+        i = (i + 1) & p->mask;
     }
     return -1U;
 }
 
-inline static void dict_add(struct dict *p, uint32_t key, uint32_t value)
+// Если ключ уже есть, значение обновляется на месте.
+// Возвращает индекс ячейки или -1U, если таблица заполнена
+inline static uint32_t dict_add(struct dict *p, uint32_t key, uint32_t value)
+{
+    if (key == DICT_KEY_EMPTY) {
+        return -1U;
+    }
+    uint32_t i = dict_hash(p, key);
+    while (p->kvs[i].key != DICT_KEY_EMPTY) {
+        if (p->kvs[i].key == key) {
+            p->kvs[i].value = value;
+            return i;
+        }
+        i = (i + 1) & p->mask;
+    }
+    if (dict_is_full(p)) {
+        return -1U;
+    }
+    p->kvs[i] = (struct keyvalue){.key = key, .value = value};
+    p->count++;
+    return i;
+}
+
+// Удаление со сдвигом следующих записей цепочки назад, без меток удаления
+inline static void dict_del_idx(struct dict *p, uint32_t idx)
+{
+    uint32_t i = idx;
+    uint32_t j = idx;
+    while (1) {
+        j = (j + 1) & p->mask;
+        if (p->kvs[j].key == DICT_KEY_EMPTY) {
+            break;
+        }
+        uint32_t home = dict_hash(p, p->kvs[j].key);
+        // Запись j остается, если ее место лежит циклически в (i, j]
+        if (((j - home) & p->mask) < ((j - i) & p->mask)) {
+            continue;
+        }
+        p->kvs[i] = p->kvs[j];
+        i = j;
+    }
+    p->kvs[i] = (struct keyvalue){.key = DICT_KEY_EMPTY};
+    p->count--;
+}
+
+inline static void dict_del(struct dict *p, uint32_t key)
 {
-    p->kvs[p->count++] = (struct keyvalue){.key = key, .value = value};
+    uint32_t idx = dict_get_idx(p, key);
+    if (idx != -1U) {
+        dict_del_idx(p, idx);
+    }
 }
 
 #endif
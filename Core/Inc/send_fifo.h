@@ -4,7 +4,8 @@
 #include <stdint.h>
 #include "tools.h"
 
-#define SEND_FIFO_SIZE (128 * 64)
+// Очередь на каждый порт-источник ответов
+#define SEND_FIFO_SIZE (128 * 16)
 
 #define USE_U8_DATA
 // #define USE_U32_DATA
@@ -34,8 +35,10 @@ inline static void send_fifo_inc_tail(struct send_fifo *f, uint32_t size)
 inline static uint8_t *send_fifo_get_ptail(struct send_fifo *f)
 {
     if (f->tail >= f->last_jump) {
-        f->tail = 0;
+        // last_jump сбрасывается раньше tail: пока tail не обнулен,
+        // запись не может перескочить в начало и выставить новый last_jump
         f->last_jump = SEND_FIFO_LEN;
+        f->tail = 0;
     }
     return &f->data[f->tail];
 }
@@ -50,11 +53,40 @@ inline static uint8_t *send_fifo_get_phead(struct send_fifo *f, uint32_t size)
     return &f->data[f->head];
 }
 
-inline static void send_fifo_push(struct send_fifo *f, void *data, uint32_t size)
+// Поместится ли запись size байт. Записи не разрываются, поэтому если
+// до конца буфера места нет, запись уходит в начало, а хвост буфера
+// теряется. head не догоняет tail: head == tail - это пустая очередь
+inline static uint32_t send_fifo_is_fit(struct send_fifo *f, uint32_t size)
 {
-    uint8_t *p = send_fifo_get_phead(f, size);
-    memcpy_u8(data, p, size);
-    send_fifo_inc_head(f, size);
+    uint32_t head = f->head;
+    uint32_t tail = f->tail;
+    if (head < tail) {
+        return (head + size) < tail;
+    }
+    if ((SEND_FIFO_LEN - head) > size) {
+        return 1;
+    }
+    if ((SEND_FIFO_LEN - head) == size) {
+        return tail != 0;
+    }
+    return size < tail;
+}
+
+// Хвост может забираться из прерывания DMA, поэтому head публикуется
+// одной записью уже после копирования посылки. 0 - места нет
+inline static uint32_t send_fifo_push(struct send_fifo *f, void *data, uint32_t size)
+{
+    if (!send_fifo_is_fit(f, size)) {
+        return 0;
+    }
+    uint32_t head = f->head;
+    if ((SEND_FIFO_LEN - head) < size) {
+        f->last_jump = head;
+        head = 0;
+    }
+    memcpy_u8(data, &f->data[head], size);
+    f->head = (head + size) & (SEND_FIFO_LEN - 1);
+    return 1;
 }
 
 inline static uint32_t send_fifo_is_empty(struct send_fifo *f)
@@ -72,6 +104,14 @@ inline static uint32_t send_fifo_is_full(struct send_fifo *f)
     return ((f->head + 1) & (SEND_FIFO_LEN - 1)) == f->tail;
 }
 
+// Занято байт записями, без пропущенного хвоста буфера
+inline static uint32_t send_fifo_used(struct send_fifo *f)
+{
+    uint32_t head = f->head;
+    uint32_t tail = f->tail;
+    return (head >= tail) ? (head - tail) : (f->last_jump - tail + head);
+}
+
 #endif
 
 #ifdef USE_U32_DATA
@@ -3,6 +3,7 @@
 
 void MX_TIM6_Init(void);
 void MX_TIM7_Init(void);
+void MX_TIM1_Init(void);
 
 #endif
 
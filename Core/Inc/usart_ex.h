@@ -6,6 +6,21 @@
 
 #define UART_COUNT 9
 
+// Прием через кольцевой буфер DMA + IDLE вместо прерывания RXNE на каждый байт
+#define UART_USE_DMA_RX
+// Передача через DMA на портах, где есть свободный поток
+#define UART_USE_DMA_TX
+// Счетчики прерываний и тактов CPU в обработчиках UART/DMA. Только для
+// сборки под замеры: чтение DWT добавляет такты каждому прерыванию.
+// Без нее CHUNK_ID_UART_IRQ_COUNT/CYCLES читаются нулями
+// #define UART_STATS
+
+#define UART_RX_RING_SIZE 256
+
+#define UART_BAUDRATE_DEFAULT 19200
+#define UART_BAUDRATE_MIN     1200
+#define UART_BAUDRATE_MAX     1000000
+
 void MX_UART4_Init(void);
 void MX_UART5_Init(void);
 void MX_UART7_Init(void);
@@ -28,6 +43,32 @@ enum uart_num {
     UART_NUM_UART9,
 };
 
+enum uart_parity {
+    UART_PARITY_NONE = 0,
+    UART_PARITY_EVEN,
+    UART_PARITY_ODD,
+};
+
+struct uart_cfg {
+    uint32_t baudrate;
+    uint8_t parity;    // enum uart_parity
+    uint8_t stop_bits; // 1 или 2
+    uint8_t over8;     // 1 - передискретизация x8, 0 - x16
+    uint8_t reserved;
+};
+
+struct uart_dma {
+    DMA_TypeDef *dma;
+    uint32_t stream;
+    uint32_t channel;
+    IRQn_Type irqn;
+};
+
+struct uart_stat {
+    uint32_t irq_count;
+    uint32_t irq_cycles;
+};
+
 struct uart {
     uint32_t num;
 
@@ -37,25 +78,58 @@ struct uart {
     } timeout;
 
     USART_TypeDef *name;
+    IRQn_Type irqn;
+
+    struct uart_cfg cfg;
 
     struct {
         uint32_t count;
         uint8_t *data;
     } rx, tx;
 
+    struct {
+        const struct uart_dma *dma;
+        uint8_t *buf;
+        uint32_t tail;
+        uint32_t poll;
+    } ring;
+
+    uint32_t tx_is_open;
+
+    const struct uart_dma *tx_dma;
+
+    struct uart_stat stat;
+
     struct gpio de;
 };
 
 extern struct uart uarts[UART_COUNT];
 
 void uart_send_array(struct uart *u, void *data, uint32_t size);
+void uart_send_begin(struct uart *u, void *data, uint32_t size);
+void uart_send_append(struct uart *u, uint32_t size);
+void uart_send_end(struct uart *u);
+void uart_send_abort(struct uart *u);
+uint32_t uart_tx_is_busy(struct uart *u);
 void uart_recv_array(struct uart *u, void *data, uint32_t size);
+void uart_recv_poll(struct uart *u, uint32_t enable);
 void uart_stop_recv(struct uart *u);
 
+void uart_dma_init(void);
+uint32_t uart_cfg_is_valid(const struct uart_cfg *cfg);
+uint32_t uart_set_cfg(struct uart *u, const struct uart_cfg *cfg);
+void uart_apply_cfg(struct uart *u);
+void uart_stat_reset(void);
+uint32_t uart_get_ms(void);
+
 void uart_irq_callback(struct uart *u);
+void uart_dma_rx_irq_callback(struct uart *u);
+void uart_dma_tx_irq_callback(struct uart *u);
 void tim6_update_callback();
 
 void uart_send_complete_callback(struct uart *u);
+void uart_send_dma_complete_callback(struct uart *u);
+void uart_recv_data_callback(struct uart *u, uint32_t count);
 void uart_recv_complete_callback(struct uart *u);
 void uart_recv_timeout_callback(struct uart *u);
 
@@ -2,25 +2,81 @@
 #include "chunk.h"
 #include "uid_hash.h"
 #include "assert.h"
+#include "stddef.h"
 #include "crc16.h"
+#include "crc32.h"
 #include "usart_ex.h"
 #include "send_fifo.h"
 #include "dict.h"
+#include "fifo.h"
+#include "tools.h"
 #include "gpio.h"
 #include "relay.h"
 #include "sens.h"
 #include "bat.h"
 #include "stm32f4xx_ll_tim.h"
+#include "autobaud.h"
 
 #define AURA_PROTOCOL      0x41525541U
-#define AURA_MAX_REPEATERS 2
 #define AURA_MAX_DATA_SIZE 128
+// Глубина очереди принятых от мастера посылок
+#define AURA_MASTER_QUEUE  4
+// Глубина очереди принятых от ведомых посылок, на каждый порт
+#define AURA_SLAVE_QUEUE   4
+// Запросов к ведомым одного порта, которые могут быть в работе одновременно.
+// На линию RS-485 следующий запрос уходит только после ответа или таймаута
+// предыдущего, остальные ждут в очереди
+#define AURA_PORT_PIPELINE   8
+// Время ожидания ответа ведомого после передачи запроса
+#define AURA_PORT_TIMEOUT_MS 250
+// Квант планировщика ответов мастеру на единицу веса порта, байт
+#define AURA_SCHED_QUANTUM   (sizeof(struct pack))
+#define AURA_SCHED_WEIGHT_MAX 16
+// Наибольший размер данных посылки CMD_ANS_CONTAINER. Расширитель выше
+// по цепочке принимает не больше AURA_MAX_DATA_SIZE
+#define AURA_CONTAINER_MTU   512
+#define AURA_COALESCE_MS_MAX 100
 
-static dict_declare(map, AURA_MAX_REPEATERS *(UART_COUNT - 1));
+// Ячеек таблицы маршрутов uid -> порт, устройств помещается 3/4 от числа
+#define AURA_MAX_ROUTES      1024
 
-#define map ((struct dict *)map_buf)
+// Через сколько секунд молчащее устройство удаляется из таблицы, 0 - никогда
+#define AURA_ROUTE_AGE_SEC   600
+// Ячеек таблицы, проверяемых на устаревание за один проход aura_process
+#define AURA_ROUTE_AGE_STEP  8
+// Сколько ждать ответы на широковещательный WHOAMI до смены поколения таблиц
+#define AURA_DISCOVERY_MS    1000
+// Устройств в кэше топологии и расширителей в пути до каждого из них
+#define AURA_TOPO_MAX        256
+#define AURA_TOPO_PATH_MAX   4
+// Время сбора ответов по умолчанию и наибольшее
+#define AURA_GATHER_MS       200
+#define AURA_GATHER_MS_MAX   2000
+// Недавние широковещательные посылки: повтор с теми же uid_src и cnt
+// с другого порта в течение AURA_DUP_MS - петля, он не пересылается
+#define AURA_DUP_CACHE       16
+#define AURA_DUP_MS          2000
+// Устройств в расписании фонового опроса и время жизни их ответов в кэше
+#define AURA_POLL_MAX        32
+#define AURA_POLL_TTL_MS     2000
 
-struct send_fifo send_fifo;
+// Заголовок v2: AURA_V2_MAGIC, адрес источника, адрес назначения,
+// затем varint cnt, cmd и data_sz. Дальше данные и crc, как в v1
+#define AURA_V2_MAGIC        0xA2
+#define AURA_V2_HDR_MIN      6
+#define AURA_V2_HDR_MAX      13
+// Ячеек таблицы uid -> адрес на линии v2
+#define AURA_V2_ADDRS        512
+
+// Два поколения таблицы маршрутов: по рабочей идет пересылка, теневая
+// заполняется во время опроса WHOAMI и затем подменяет рабочую
+static dict_declare(map0, AURA_MAX_ROUTES);
+static dict_declare(map1, AURA_MAX_ROUTES);
+static struct dict *volatile map = (struct dict *)map0_buf;
+static struct dict *map_shadow = 0;
+
+// Ответы мастеру копятся по портам-источникам, 0 - ответы самого расширителя
+static struct send_fifo send_fifos[UART_COUNT];
 
 enum state_recv {
     STATE_RECV_START = 0,
@@ -37,57 +93,2108 @@ enum cmd {
     CMD_ANS_WRITE = 6,
     CMD_REQ_READ = 7,
     CMD_ANS_READ = 8,
+    // Расширитель потерял запрос или ответ из-за переполнения очереди
+    CMD_ANS_BUSY = 10,
+    // Сбор ответов всех устройств на широковещательный запрос в сводные посылки
+    CMD_REQ_GATHER = 11,
+    CMD_ANS_GATHER = 12,
+    // Несколько ответов подряд, каждый целиком с crc в chunk CHUNK_ID_FRAME
+    CMD_ANS_CONTAINER = 14,
+    // Несколько запросов к разным устройствам в chunk'ах CHUNK_ID_BULK_REQ
+    CMD_REQ_BULK = 15,
+};
+
+// Старший бит cmd: данные начинаются с CHUNK_ID_SRC_ROUTE, и посылка
+// пересылается по списку портов, без таблицы маршрутов
+#define CMD_FLAG_SRC_ROUTE 0x8000U
+#define SRC_ROUTE_END      0xFF
+
+// Что делать с ответом, если очередь его порта переполнена
+enum send_policy {
+    SEND_POLICY_DROP_NEWEST = 0,
+    SEND_POLICY_DROP_OLDEST,
+    SEND_POLICY_PRIO, // ответ на запись вытесняет старые, остальные теряются
+};
+
+enum device_type {
+    DEVICE_TYPE_LB75BD = 1,
+    DEVICE_TYPE_TMP112,
+    DEVICE_TYPE_SHT30,
+    DEVICE_TYPE_ZS05,
+    DEVICE_TYPE_BMP180,
+    DEVICE_TYPE_LPS22HB,
+    DEVICE_TYPE_DOORKNOT,
+    DEVICE_TYPE_EXPANDER,
+    DEVICE_TYPE_WETSENS,
+};
+
+struct header {
+    const uint32_t protocol;
+    uint32_t cnt;
+    uint32_t uid_src;
+    uint32_t uid_dest;
+    uint16_t cmd;
+    uint16_t data_sz;
+};
+
+struct __PACKED pack {
+    struct header header;
+    uint8_t data[AURA_MAX_DATA_SIZE];
+    crc16_t crc;
+#ifdef AURA_CRC32
+    // Место под старшую половину crc32 при полной посылке
+    uint16_t crc32_hi;
+#endif
+};
+
+static struct __PACKED pack pack_ans = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+
+struct aura_stat {
+    uint32_t master_rx;
+    uint32_t master_drop;
+    uint32_t cut_through;
+    uint32_t cut_through_abort;
+    uint32_t busy_sent;
+    uint32_t route_full;
+    uint32_t route_aged;
+    uint32_t route_gen;
+    uint32_t whoami_cached;
+    uint32_t src_routed;
+    uint32_t gather_dev;
+    uint32_t gather_skip;
+    uint32_t up_frames;
+    uint32_t up_bytes;
+    uint32_t up_payload;
+    uint32_t up_containers;
+    uint32_t bulk_sub;
+    uint32_t bulk_skip;
+    uint32_t poll_sent;
+    uint32_t poll_hit;
+    uint32_t poll_miss;
+    uint32_t rx_resync;
+    uint32_t v2_rx;
+    uint32_t v2_tx;
+    uint32_t v2_unknown;
+    uint32_t late_drop;
+    uint32_t src_route_bad;
+};
+
+// Адреса на линии v2. Мастер и сам расширитель - постоянные, устройства
+// за расширителем получают адреса от LINK_ADDR_FIRST по мере обнаружения
+enum link_addr {
+    LINK_ADDR_BROADCAST = 0,
+    LINK_ADDR_PEER = 1,
+    LINK_ADDR_SELF = 2,
+    LINK_ADDR_FIRST = 3,
+    LINK_ADDR_COUNT = 255,
+};
+
+// Запись расписания фонового опроса и последний ответ устройства на cmd.
+// uid 0 - свободная запись
+struct poll_entry {
+    uint32_t uid;
+    uint16_t cmd;
+    uint16_t period_ms;
+    uint32_t ms;
+    uint32_t is_pending;
+    uint32_t is_cached;
+    uint32_t cache_ms;
+    uint32_t cache_cnt;
+    uint16_t cache_cmd;
+    uint16_t cache_sz;
+    uint8_t cache[AURA_MAX_DATA_SIZE];
+};
+
+struct gather {
+    uint32_t is_running;
+    uint32_t uid_master;
+    uint32_t ms;
+    uint32_t deadline_ms;
+    uint32_t count;
+    void *next_chunk;
+};
+
+struct dup_entry {
+    uint32_t uid_src;
+    uint32_t cnt;
+    uint32_t ms;
+    uint32_t port;
+};
+
+// Ответ устройства на WHOAMI: тип и uid расширителей на пути к нему
+struct topo_dev {
+    uint32_t uid;
+    uint32_t type;
+    uint32_t port;
+    uint32_t path_len;
+    uint32_t path[AURA_TOPO_PATH_MAX];
+};
+
+struct topo {
+    uint32_t count;
+    uint32_t is_valid;
+    struct topo_dev devs[AURA_TOPO_MAX];
+};
+
+// Выдача ответов на WHOAMI из кэша по мере места в send_fifos
+struct topo_replay {
+    uint32_t is_running;
+    uint32_t idx;
+    uint32_t uid_master;
+};
+
+// Потерянные посылки, о которых мастер узнает посылкой CMD_ANS_BUSY
+struct busy {
+    volatile uint32_t is_pending;
+    uint32_t uid_master;
+    uint32_t uid;
+    uint32_t count;
+};
+
+enum req_state {
+    REQ_STATE_FREE = 0,
+    REQ_STATE_QUEUED,
+    REQ_STATE_SENDING,
+    REQ_STATE_WAIT,
+    // Слот выдан, запрос в него еще копируется: ни выдать, ни передать
+    REQ_STATE_ALLOC,
+};
+
+// Запись реле вытесняет опросы: передается раньше и при переполнении
+// очереди занимает место самого нового опроса
+enum req_prio {
+    REQ_PRIO_LOW = 0,
+    REQ_PRIO_HIGH,
+};
+
+// Запрос мастера к ведомому порта: ключ - header.uid_dest и header.cnt
+struct port_req {
+    volatile enum req_state state;
+    enum req_prio prio;
+    uint32_t seq;
+    uint32_t ms; // в очереди - время постановки, после передачи - время отправки
+    struct pack pack;
+};
+
+struct port {
+    struct port_req reqs[AURA_PORT_PIPELINE];
+    uint32_t seq;
+};
+
+struct port_stat {
+    uint32_t sent;
+    uint32_t replies;
+    uint32_t unmatched;
+    uint32_t timeout;
+    uint32_t drop;
+    uint32_t preempt;
+    uint32_t depth;
+    uint32_t depth_max;
+    uint32_t wait_ms;
+    uint32_t wait_ms_max;
+    uint32_t rx_drop;
+};
+
+// Deficit round robin по очередям send_fifos
+struct sched {
+    uint32_t cur;
+    uint32_t is_visited;
+    uint32_t deficit[UART_COUNT];
+    uint32_t weights[UART_COUNT];
+    uint32_t hol_ms[UART_COUNT];     // время, с которого голова очереди ждет
+    uint32_t hol_ms_max[UART_COUNT];
+};
+
+struct cut_through {
+    struct uart *dst;
+    struct port_req *req;
+    uint32_t sent;
+    uint32_t size;
+};
+
+static enum state_recv states_recv[UART_COUNT] = {0};
+// CRC принимаемой посылки считается по мере прихода байт, к концу
+// посылки верная дает 0
+static crc16_t crcs_rx[UART_COUNT];
+// Длина принимаемой посылки без crc, известна после разбора заголовка
+static uint32_t rx_body[UART_COUNT];
+// Ответы ведомых принимаются по кругу так же, как посылки мастера:
+// следующий ответ не затирает еще не разобранный. Порт 0 не используется
+static struct pack slave_packs[UART_COUNT][AURA_SLAVE_QUEUE + 1] __ALIGNED(8);
+static uint32_t slave_rx_idx[UART_COUNT] = {0};
+static uint32_t slave_fifos_buf[UART_COUNT][sizeof(struct fifo) / sizeof(uint32_t) + AURA_SLAVE_QUEUE] = {
+    [0 ... UART_COUNT - 1] = {[0] = AURA_SLAVE_QUEUE - 1},
+};
+#define slave_fifo(_num) ((struct fifo *)slave_fifos_buf[_num])
+static struct port ports[UART_COUNT] __ALIGNED(8);
+static struct port_stat port_stats[UART_COUNT] = {0};
+static struct sched sched = {
+    .weights = {[0 ... UART_COUNT - 1] = 1},
+};
+static enum send_policy send_policy = SEND_POLICY_PRIO;
+static uint32_t send_drops[UART_COUNT] = {0};
+static struct busy busy = {0};
+// Посылка мастеру копируется сюда, чтобы место в send_fifos
+// освобождалось сразу
+static struct __PACKED pack pack_tx = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+#ifdef AURA_CONTAINER
+struct __PACKED pack_container {
+    struct header header;
+    uint8_t data[AURA_CONTAINER_MTU];
+    crc16_t crc;
+#ifdef AURA_CRC32
+    uint16_t crc32_hi;
+#endif
+};
+
+static struct __PACKED pack_container pack_container = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+static uint32_t coalesce_ms = AURA_COALESCE_MS;
+// Размер данных контейнера, который принимает мастер; 0 - контейнеры
+// не собираются, пока мастер их не включит
+static uint32_t container_mtu = 0;
+#endif
+
+// Посылки мастера принимаются по кругу: до (AURA_MASTER_QUEUE - 1) в очереди,
+// одна в обработке и одна в приеме, поэтому буферов на один больше
+static struct pack master_packs[AURA_MASTER_QUEUE + 1] __ALIGNED(8);
+static uint32_t master_rx_idx = 0;
+static fifo_declare(master_fifo, AURA_MASTER_QUEUE);
+#define master_fifo ((struct fifo *)master_fifo_buf)
+static struct pack *master_rx_pack = &master_packs[0];
+static volatile uint32_t aura_flag_master_work = 0;
+#ifdef AURA_CUT_THROUGH
+static struct cut_through cut_through = {0};
+#endif
+
+static struct aura_stat aura_stat = {0};
+static uint32_t aura_flag_send_delay = 0;
+static uint32_t cnt_send_pack = 0;
+static uint32_t aura_sec = 0;
+static uint32_t aura_sec_ms = 0;
+static uint32_t route_age_sec = AURA_ROUTE_AGE_SEC;
+static uint32_t route_age_idx = 0;
+static uint32_t route_discovery_ms = 0;
+static struct topo topos[2];
+static struct topo *topo = &topos[0];
+static struct topo *topo_shadow = 0;
+static struct topo_replay topo_replay = {0};
+static uint32_t whoami_cache = 0;
+static struct gather gather = {0};
+static struct __PACKED pack pack_gather = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+static struct __PACKED pack pack_gather_req = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+static struct __PACKED pack pack_bulk = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+static struct poll_entry polls[AURA_POLL_MAX] = {0};
+static uint32_t poll_ttl_ms = AURA_POLL_TTL_MS;
+static struct __PACKED pack pack_poll = {
+    .header = {.protocol = AURA_PROTOCOL},
+};
+static struct dup_entry dup_cache[AURA_DUP_CACHE] = {0};
+static uint32_t dup_idx = 0;
+static uint32_t dup_suppressed[UART_COUNT] = {0};
+static struct __PACKED pack pack_whoami = {
+    .header = {.protocol = AURA_PROTOCOL},
 };
+static struct uart_cfg uart0_cfg_pending;
+static uint32_t aura_flag_uart0_cfg = 0;
+// Настройки линии с мастером меняются после передачи ответа на запрос,
+// который их поменял: ответ помечается cnt при постановке в очередь,
+// aura_flag_switch_tx - он в текущей передаче USART1
+static uint32_t switch_ack_cnt = 0;
+static uint32_t aura_flag_switch_ack = 0;
+static uint32_t aura_flag_switch_tx = 0;
+#ifdef AURA_CRC32
+// Порты, где посылки закрыты crc32, по биту на порт. Для USART1
+// новое значение вступает в силу после ответа мастеру
+static uint32_t crc32_ports = 0;
+static uint32_t crc32_ports_pending = 0;
+static uint32_t aura_flag_crc32_ports = 0;
+#endif
+#ifdef AURA_V2
+// Заголовок v2 на линии с мастером; включается после ответа мастеру
+static uint32_t v2_link = 0;
+static uint32_t v2_link_pending = 0;
+static uint32_t aura_flag_v2_link = 0;
+static uint32_t v2_peer_uid = 0;
+static dict_declare(link_addrs, AURA_V2_ADDRS);
+#define link_addrs ((struct dict *)link_addrs_buf)
+// uid по адресу на линии, 0 - адрес свободен
+static uint32_t link_uids[LINK_ADDR_COUNT] = {0};
+static uint32_t link_addr_next = LINK_ADDR_FIRST;
+static uint32_t link_addr_age_idx = LINK_ADDR_FIRST;
+// Поколение таблицы адресов: растет при каждом освобождении адреса
+static uint32_t link_addr_gen = 0;
+#endif
+#ifdef AURA_AUTOBAUD
+static uint32_t autobaud_errors_max = AURA_AUTOBAUD_ERRORS;
+static uint32_t autobaud_errors = 0;
+#endif
+
+static struct pack *aura_rx_pack(uint32_t num)
+{
+    return (num == 0) ? master_rx_pack : &slave_packs[num][slave_rx_idx[num]];
+}
+
+static uint32_t aura_is_crc32(uint32_t num)
+{
+#ifdef AURA_CRC32
+    return (crc32_ports >> num) & 1U;
+#else
+    (void)num;
+    return 0;
+#endif
+}
+
+static uint32_t aura_crc_size(uint32_t num)
+{
+    return aura_is_crc32(num) ? sizeof(crc32_t) : sizeof(crc16_t);
+}
+
+// Внутри расширителя посылки всегда с crc16, на линии с crc32 она
+// заменяется перед передачей. Возвращает размер посылки на линии
+static uint32_t aura_crc_seal(uint32_t num, void *p, uint32_t size)
+{
+    if (!aura_is_crc32(num)) {
+        return size;
+    }
+    uint32_t body = size - sizeof(crc16_t);
+    crc32_t crc = crc32_calc(p, body);
+    uint8_t *t = (uint8_t *)p + body;
+    for (uint32_t i = 0; i < sizeof(crc); i++) {
+        t[i] = (uint8_t)(crc >> (8 * i));
+    }
+    return body + sizeof(crc);
+}
+
+// Проверка принятой посылки длиной body без crc. Посылка с crc32
+// получает crc16 данных, посчитанную при приеме
+static uint32_t aura_crc_check(uint32_t num, struct pack *p, uint32_t body)
+{
+    if (!aura_is_crc32(num)) {
+        return crcs_rx[num] == 0;
+    }
+    const uint8_t *t = (const uint8_t *)p + body;
+    crc32_t crc = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t)t[3] << 24);
+    if (crc32_calc(p, body) != crc) {
+        return 0;
+    }
+    crc16_set(p, body, crcs_rx[num]);
+    return 1;
+}
+
+static uint32_t aura_pack_size(const struct pack *p)
+{
+    return sizeof(struct header) + p->header.data_sz + sizeof(crc16_t);
+}
+
+static uint32_t aura_is_v2(uint32_t num)
+{
+#ifdef AURA_V2
+    return (num == 0) && v2_link;
+#else
+    (void)num;
+    return 0;
+#endif
+}
+
+#ifdef AURA_V2
+static uint32_t varint_put(uint8_t *b, uint32_t val)
+{
+    uint32_t n = 0;
+    while (val >= 0x80) {
+        b[n++] = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    b[n++] = (uint8_t)val;
+    return n;
+}
+
+static uint32_t varint_get(const uint8_t *b, uint32_t *pos)
+{
+    uint32_t val = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = b[(*pos)++];
+        val |= (uint32_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return val;
+}
+
+// Длина заголовка v2 по уже принятым have байтам. Пока varint не
+// дочитан - сколько байт нужно как минимум, 0 - заголовок неверен
+static uint32_t v2_header_size(const uint8_t *b, uint32_t have)
+{
+    static const uint8_t field_max[] = {5, 3, 2}; // cnt, cmd, data_sz
+    uint32_t pos = 3;
+    for (uint32_t f = 0; f < arr_len(field_max); f++) {
+        for (uint32_t n = 1;; n++) {
+            if (pos >= have) {
+                return pos + arr_len(field_max) - f;
+            }
+            if ((b[pos++] & 0x80) == 0) {
+                break;
+            }
+            if (n == field_max[f]) {
+                return 0;
+            }
+        }
+    }
+    return pos;
+}
+
+static uint32_t v2_data_sz(const uint8_t *b)
+{
+    uint32_t pos = 3;
+    varint_get(b, &pos);
+    varint_get(b, &pos);
+    return varint_get(b, &pos);
+}
+
+// Адрес на линии выдается при первом появлении uid в таблице маршрутов.
+// Освобожденные адреса выдаются снова, только когда новые кончились:
+// у мастера есть время перечитать таблицу
+static void link_addr_learn(uint32_t uid)
+{
+    if ((uid == pack_ans.header.uid_src)
+        || (dict_get_idx(link_addrs, uid) != -1U)) {
+        return;
+    }
+    uint32_t addr = link_addr_next;
+    for (uint32_t a = LINK_ADDR_FIRST; (addr >= LINK_ADDR_COUNT) && (a < LINK_ADDR_COUNT); a++) {
+        if (link_uids[a] == 0) {
+            addr = a;
+        }
+    }
+    if (addr >= LINK_ADDR_COUNT) {
+        return;
+    }
+    // Таблицу читает и прерывание приема
+    __disable_irq();
+    uint32_t idx = dict_add(link_addrs, uid, addr);
+    if (idx != -1U) {
+        link_uids[addr] = uid;
+    }
+    __enable_irq();
+    if ((idx != -1U) && (addr == link_addr_next)) {
+        link_addr_next++;
+    }
+}
+
+static uint32_t link_addr_get(uint32_t uid)
+{
+    if (uid == 0) {
+        return LINK_ADDR_BROADCAST;
+    }
+    if (uid == v2_peer_uid) {
+        return LINK_ADDR_PEER;
+    }
+    if (uid == pack_ans.header.uid_src) {
+        return LINK_ADDR_SELF;
+    }
+    uint32_t idx = dict_get_idx(link_addrs, uid);
+    return (idx == -1U) ? -1U : link_addrs->kvs[idx].value;
+}
+
+// Линия с мастером возвращается к v1 до нового согласования: автоподбор
+// скорости узнает только 'A' заголовка v1. Адреса выдаются заново
+static void aura_v2_reset(void)
+{
+    v2_link = 0;
+    v2_link_pending = 0;
+    aura_flag_v2_link = 0;
+    dict_clear(link_addrs);
+    for (uint32_t i = 0; i < LINK_ADDR_COUNT; i++) {
+        link_uids[i] = 0;
+    }
+    link_addr_next = LINK_ADDR_FIRST;
+    link_addr_age_idx = LINK_ADDR_FIRST;
+    link_addr_gen++;
+}
+
+// -1U - адрес никому не выдан
+static uint32_t link_addr_uid(uint32_t addr)
+{
+    switch (addr) {
+    case LINK_ADDR_BROADCAST:
+        return 0;
+    case LINK_ADDR_PEER:
+        return v2_peer_uid;
+    case LINK_ADDR_SELF:
+        return pack_ans.header.uid_src;
+    default:
+        return ((addr < LINK_ADDR_COUNT) && (link_uids[addr] != 0)) ? link_uids[addr] : -1U;
+    }
+}
+#endif
+
+// Посылка v1 с crc16 переписывается на месте в v2 для линии num.
+// Если адресов нет, уходит как v1. Возвращает новый размер
+static uint32_t aura_v2_encode(uint32_t num, void *frame, uint32_t size)
+{
+#ifdef AURA_V2
+    struct pack *p = frame;
+    if (!aura_is_v2(num)) {
+        return size;
+    }
+    uint32_t src = link_addr_get(p->header.uid_src);
+    uint32_t dst = link_addr_get(p->header.uid_dest);
+    if ((src == -1U) || (dst == -1U)) {
+        return size;
+    }
+    uint8_t hdr[AURA_V2_HDR_MAX];
+    uint32_t n = 0;
+    hdr[n++] = AURA_V2_MAGIC;
+    hdr[n++] = src;
+    hdr[n++] = dst;
+    n += varint_put(&hdr[n], p->header.cnt);
+    n += varint_put(&hdr[n], p->header.cmd);
+    n += varint_put(&hdr[n], p->header.data_sz);
+    uint32_t data_sz = p->header.data_sz;
+    uint8_t *b = frame;
+    memcpy_u8(hdr, b, n);
+    if (data_sz != 0) {
+        memcpy_u8(&b[sizeof(struct header)], &b[n], data_sz);
+    }
+    size = n + data_sz + sizeof(crc16_t);
+    crc16_add2pack(b, size);
+    aura_stat.v2_tx++;
+    return size;
+#else
+    (void)num;
+    (void)frame;
+    return size;
+#endif
+}
+
+#ifdef AURA_V2
+// Принятая посылка v2 с заголовком длиной hdr_size переписывается
+// на месте в v1. 0 - адрес не выдан
+static uint32_t aura_v2_decode(struct pack *p, uint32_t hdr_size)
+{
+    uint8_t *b = (uint8_t *)p;
+    uint32_t pos = 3;
+    uint32_t uid_src = link_addr_uid(b[1]);
+    uint32_t uid_dest = link_addr_uid(b[2]);
+    uint32_t cnt = varint_get(b, &pos);
+    uint32_t cmd = varint_get(b, &pos);
+    uint32_t data_sz = varint_get(b, &pos);
+    if ((uid_src == -1U) || (uid_dest == -1U)) {
+        aura_stat.v2_unknown++;
+        return 0;
+    }
+    // Данные сдвигаются к концу, копия с хвоста
+    for (uint32_t i = data_sz; i > 0; i--) {
+        b[sizeof(struct header) + i - 1] = b[hdr_size + i - 1];
+    }
+    const uint32_t protocol = AURA_PROTOCOL;
+    memcpy_u8((void *)&protocol, b, sizeof(protocol));
+    p->header.cnt = cnt;
+    p->header.uid_src = uid_src;
+    p->header.uid_dest = uid_dest;
+    p->header.cmd = cmd;
+    p->header.data_sz = data_sz;
+    crc16_add2pack(p, aura_pack_size(p));
+    aura_stat.v2_rx++;
+    return 1;
+}
+#endif
+
+// uid - устройство, чей запрос или ответ потерян. Вызывается из main
+// и из прерываний, в том числе уже с запрещенными прерываниями
+static void aura_busy(uint32_t uid_master, uint32_t uid)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    busy.uid_master = uid_master;
+    busy.uid = uid;
+    busy.count++;
+    busy.is_pending = 1;
+    __set_PRIMASK(primask);
+}
+
+// Запросы - нечетные cmd, ответы - четные
+static uint32_t aura_is_req(const struct pack *p)
+{
+    return (p->header.cmd & 1) != 0;
+}
+
+static enum req_prio aura_req_prio(const struct pack *p)
+{
+    return (p->header.cmd == CMD_REQ_WRITE) ? REQ_PRIO_HIGH : REQ_PRIO_LOW;
+}
+
+static uint32_t port_req_count(uint32_t num, enum req_state state)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        count += (ports[num].reqs[i].state == state);
+    }
+    return count;
+}
+
+static struct port_req *port_req_alloc(uint32_t num, enum req_prio prio)
+{
+    struct port *pt = &ports[num];
+    struct port_req *victim = 0;
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        struct port_req *r = &pt->reqs[i];
+        if (r->state == REQ_STATE_FREE) {
+            victim = r;
+            break;
+        }
+        // Вытесняется самый новый из стоящих в очереди запросов ниже классом
+        if ((r->state == REQ_STATE_QUEUED) && (r->prio < prio)
+            && ((victim == 0) || ((int32_t)(r->seq - victim->seq) > 0))) {
+            victim = r;
+        }
+    }
+    if (victim == 0) {
+        return 0;
+    }
+    if (victim->state != REQ_STATE_FREE) {
+        port_stats[num].preempt++;
+        port_stats[num].drop++;
+        aura_busy(victim->pack.header.uid_src, victim->pack.header.uid_dest);
+    }
+    victim->state = REQ_STATE_ALLOC;
+    victim->prio = prio;
+    victim->seq = pt->seq++;
+    victim->ms = uart_get_ms();
+    return victim;
+}
+
+static struct port_req *port_req_oldest(uint32_t num, enum req_state state)
+{
+    struct port_req *oldest = 0;
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        struct port_req *r = &ports[num].reqs[i];
+        if ((r->state == state)
+            && ((oldest == 0) || ((int32_t)(r->seq - oldest->seq) < 0))) {
+            oldest = r;
+        }
+    }
+    return oldest;
+}
+
+// Ведомые еще могут отвечать на переданный запрос: линия занята.
+// На широковещательный отвечают все, он держит линию до таймаута
+static uint32_t port_is_waiting(uint32_t num)
+{
+    return port_req_count(num, REQ_STATE_WAIT) != 0;
+}
+
+// Вызывается из прерывания конца передачи порта или из main
+// с запрещенными прерываниями
+static void port_send_next(uint32_t num)
+{
+    struct uart *u = &uarts[num];
+    if (uart_tx_is_busy(u) || port_is_waiting(num)) {
+        return;
+    }
+    struct port_req *r = 0;
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        struct port_req *q = &ports[num].reqs[i];
+        if ((q->state == REQ_STATE_QUEUED)
+            && ((r == 0) || (q->prio > r->prio)
+                || ((q->prio == r->prio) && ((int32_t)(q->seq - r->seq) < 0)))) {
+            r = q;
+        }
+    }
+    if (r == 0) {
+        return;
+    }
+    struct port_stat *st = &port_stats[num];
+    uint32_t wait_ms = uart_get_ms() - r->ms;
+    st->wait_ms += wait_ms;
+    if (wait_ms > st->wait_ms_max) {
+        st->wait_ms_max = wait_ms;
+    }
+    r->state = REQ_STATE_SENDING;
+    uart_send_array(u, &r->pack, aura_crc_seal(num, &r->pack, aura_pack_size(&r->pack)));
+}
+
+static void port_send_complete(uint32_t num)
+{
+    struct port_req *r = port_req_oldest(num, REQ_STATE_SENDING);
+    if (r) {
+        r->ms = uart_get_ms();
+        r->state = REQ_STATE_WAIT;
+        port_stats[num].sent++;
+    }
+    // Следующий запрос уходит, когда придет ответ или истечет таймаут
+    port_send_next(num);
+}
+
+static void port_reply_match(uint32_t num, const struct pack *p)
+{
+    // Ведомые не повторяют cnt запроса, поэтому ответ относится
+    // к самому старому запросу к этому uid
+    struct port_req *match = 0;
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        struct port_req *r = &ports[num].reqs[i];
+        uint32_t uid_dest = r->pack.header.uid_dest;
+        if ((r->state == REQ_STATE_WAIT)
+            && ((uid_dest == p->header.uid_src) || (uid_dest == 0))
+            && (r->pack.header.uid_src == p->header.uid_dest)
+            && ((match == 0) || ((int32_t)(r->seq - match->seq) < 0))) {
+            match = r;
+        }
+    }
+    if (match == 0) {
+        port_stats[num].unmatched++;
+        return;
+    }
+    port_stats[num].replies++;
+    // На широковещательный запрос отвечают все, он живет до таймаута
+    if (match->pack.header.uid_dest != 0) {
+        __disable_irq();
+        match->state = REQ_STATE_FREE;
+        port_send_next(num);
+        __enable_irq();
+    }
+}
+
+static void port_work_timeouts(uint32_t num)
+{
+    uint32_t ms = uart_get_ms();
+    for (uint32_t i = 0; i < AURA_PORT_PIPELINE; i++) {
+        struct port_req *r = &ports[num].reqs[i];
+        if ((r->state != REQ_STATE_WAIT) || (ms - r->ms < AURA_PORT_TIMEOUT_MS)) {
+            continue;
+        }
+        if (r->pack.header.uid_dest != 0) {
+            port_stats[num].timeout++;
+        }
+        __disable_irq();
+        r->state = REQ_STATE_FREE;
+        port_send_next(num);
+        __enable_irq();
+    }
+}
+
+static void send_resp_drop(uint32_t num, const struct pack *p)
+{
+    send_drops[num]++;
+    aura_busy(p->header.uid_dest, p->header.uid_src);
+}
+
+static void send_resp_push(uint32_t num, void *p, uint32_t size)
+{
+    struct send_fifo *f = &send_fifos[num];
+    uint32_t is_drop_oldest = (send_policy == SEND_POLICY_DROP_OLDEST)
+        || ((send_policy == SEND_POLICY_PRIO)
+            && (((struct pack *)p)->header.cmd == CMD_ANS_WRITE));
+    if (is_drop_oldest) {
+        // Хвост очереди забирается и из прерывания DMA
+        __disable_irq();
+        while (!send_fifo_is_fit(f, size) && send_fifo_is_not_empty(f)) {
+            struct pack *old = (struct pack *)send_fifo_get_ptail(f);
+            send_resp_drop(num, old);
+            send_fifo_inc_tail(f, aura_pack_size(old));
+        }
+        __enable_irq();
+    }
+    if (send_fifo_is_empty(f)) {
+        sched.hol_ms[num] = uart_get_ms();
+    }
+    if (!send_fifo_push(f, p, size)) {
+        send_resp_drop(num, p);
+    }
+}
+
+static uint32_t send_resp_is_empty(void)
+{
+    if (busy.is_pending) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < UART_COUNT; i++) {
+        if (send_fifo_is_not_empty(&send_fifos[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifdef AURA_CONTAINER
+// Ответы копятся, пока их меньше MTU и самый старый ждет меньше coalesce_ms
+static uint32_t send_resp_is_ready(void)
+{
+    if ((container_mtu == 0) || (coalesce_ms == 0) || busy.is_pending) {
+        return 1;
+    }
+    uint32_t ms = uart_get_ms();
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < UART_COUNT; i++) {
+        struct send_fifo *f = &send_fifos[i];
+        if (send_fifo_is_empty(f)) {
+            continue;
+        }
+        if (ms - sched.hol_ms[i] >= coalesce_ms) {
+            return 1;
+        }
+        used += send_fifo_used(f);
+    }
+    return used >= container_mtu;
+}
+#endif
+
+static void aura_send_delay_start(void)
+{
+#ifdef DELAY
+    LL_TIM_SetCounter(TIM7, 0);
+    aura_flag_send_delay = 1;
+#endif
+}
+
+// Посылки самого расширителя запоминаются с портом UART_COUNT:
+// вернувшись с любого порта, они не пересылаются
+static void dup_add(uint32_t num, const struct pack *p)
+{
+    dup_cache[dup_idx] = (struct dup_entry){
+        .uid_src = p->header.uid_src,
+        .cnt = p->header.cnt,
+        .ms = uart_get_ms(),
+        .port = num,
+    };
+    dup_idx = (dup_idx + 1) % AURA_DUP_CACHE;
+}
+
+// Возвращает 1, если широковещательная посылка уже проходила через
+// другой порт. Повтор с того же порта - переспрос потерянной посылки
+static uint32_t dup_check(uint32_t num, const struct pack *p)
+{
+    uint32_t ms = uart_get_ms();
+    for (uint32_t i = 0; i < AURA_DUP_CACHE; i++) {
+        struct dup_entry *e = &dup_cache[i];
+        if ((e->uid_src == p->header.uid_src)
+            && (e->cnt == p->header.cnt)
+            && (ms - e->ms < AURA_DUP_MS)) {
+            if (e->port == num) {
+                e->ms = ms;
+                return 0;
+            }
+            dup_suppressed[num]++;
+            return 1;
+        }
+    }
+    dup_add(num, p);
+    return 0;
+}
+
+// Значение маршрута: младший байт - порт, старшие 24 бита - секунда,
+// когда устройство было слышно последний раз
+#define ROUTE_PORT_MASK 0xFFU
+#define ROUTE_SEC_MASK  0xFFFFFFU
+
+static uint32_t route_get_port(uint32_t uid)
+{
+    struct dict *m = map;
+    uint32_t idx = dict_get_idx(m, uid);
+    return (idx == -1U) ? -1U : (m->kvs[idx].value & ROUTE_PORT_MASK);
+}
+
+// Рабочая таблица меняется только из main, а читается и из прерывания
+// приема. Теневая читается только из main
+static void route_learn(uint32_t uid, uint32_t port)
+{
+    uint32_t value = ((aura_sec & ROUTE_SEC_MASK) << 8) | port;
+    uint32_t is_new = (dict_get_idx(map, uid) == -1U);
+    __disable_irq();
+    uint32_t idx = dict_add(map, uid, value);
+    __enable_irq();
+    // Нового устройства нет в кэше топологии: следующий WHOAMI опросит шины
+    if (is_new) {
+        topo->is_valid = 0;
+    }
+    if (map_shadow && (dict_add(map_shadow, uid, value) == -1U)) {
+        idx = -1U;
+    }
+    if (idx == -1U) {
+        aura_stat.route_full++;
+    }
+#ifdef AURA_V2
+    link_addr_learn(uid);
+#endif
+}
+
+// Расширители пути из CHUNK_ID_UIDS доступны через тот же порт, что
+// и ответившее устройство, поэтому маршрут есть на любой глубине цепочки
+static void route_learn_path(uint32_t num, const struct pack *p)
+{
+    if (p->header.data_sz <= sizeof(struct chunk_u32)) {
+        return;
+    }
+    const struct chunk_u32arr *c_arr =
+        (const struct chunk_u32arr *)((const struct chunk_u32 *)p->data + 1);
+    uint32_t count = c_arr->hdr.size / sizeof(uint32_t);
+    uint32_t count_max = (p->header.data_sz - sizeof(struct chunk_u32)
+                          - sizeof(struct chunk_hdr)) / sizeof(uint32_t);
+    if ((c_arr->hdr.id != CHUNK_ID_UIDS) || (count > count_max)) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        // Свой uid в пути - петля, такой маршрут не нужен
+        if (c_arr->arr[i] != pack_ans.header.uid_src) {
+            route_learn(c_arr->arr[i], num);
+        }
+    }
+}
+
+static void route_discovery_start(void)
+{
+    // Повторный WHOAMI во время опроса продлевает текущий опрос
+    if (map_shadow == 0) {
+        map_shadow = (map == (struct dict *)map0_buf) ? (struct dict *)map1_buf
+                                                      : (struct dict *)map0_buf;
+        topo_shadow = (topo == &topos[0]) ? &topos[1] : &topos[0];
+        dict_clear(map_shadow);
+        topo_shadow->count = 0;
+        topo_shadow->is_valid = 1;
+    }
+    route_discovery_ms = uart_get_ms();
+}
+
+static void route_discovery_work(void)
+{
+    if ((map_shadow == 0) || (uart_get_ms() - route_discovery_ms < AURA_DISCOVERY_MS)) {
+        return;
+    }
+    // Подмена одной записью указателя, пересылка не прерывается
+    map = map_shadow;
+    topo = topo_shadow;
+    map_shadow = 0;
+    topo_shadow = 0;
+    aura_stat.route_gen++;
+}
+
+static void topo_add(uint32_t num, const struct pack *p)
+{
+    if (topo_shadow == 0) {
+        return;
+    }
+    const struct chunk_u32 *c = (const struct chunk_u32 *)p->data;
+    const struct chunk_u32arr *c_arr = (const struct chunk_u32arr *)(c + 1);
+    uint32_t path_len = (p->header.data_sz > sizeof(struct chunk_u32))
+                        ? c_arr->hdr.size / sizeof(uint32_t)
+                        : 0;
+    struct topo_dev *d = 0;
+    for (uint32_t i = 0; i < topo_shadow->count; i++) {
+        if (topo_shadow->devs[i].uid == p->header.uid_src) {
+            d = &topo_shadow->devs[i];
+            break;
+        }
+    }
+    if ((d == 0) && (topo_shadow->count < AURA_TOPO_MAX)) {
+        d = &topo_shadow->devs[topo_shadow->count++];
+    }
+    // Неполный кэш для ответов не годится, WHOAMI будет пересылаться
+    if ((d == 0) || (path_len > AURA_TOPO_PATH_MAX)) {
+        topo_shadow->is_valid = 0;
+        return;
+    }
+    d->uid = p->header.uid_src;
+    d->type = c->val;
+    d->port = num;
+    d->path_len = path_len;
+    for (uint32_t i = 0; i < path_len; i++) {
+        d->path[i] = c_arr->arr[i];
+    }
+}
+
+static void topo_replay_start(uint32_t uid_master)
+{
+    topo_replay.uid_master = uid_master;
+    topo_replay.idx = 0;
+    topo_replay.is_running = 1;
+}
+
+static void topo_replay_work(void)
+{
+    while (topo_replay.is_running) {
+        if (topo_replay.idx >= topo->count) {
+            topo_replay.is_running = 0;
+            return;
+        }
+        const struct topo_dev *d = &topo->devs[topo_replay.idx];
+        struct pack *p = &pack_whoami;
+        void *next_chunk = p->data;
+        uint32_t path[AURA_TOPO_PATH_MAX + 1];
+        for (uint32_t i = 0; i < d->path_len; i++) {
+            path[i] = d->path[i];
+        }
+        path[d->path_len] = pack_ans.header.uid_src;
+        chunk_u32_add(&next_chunk, CHUNK_ID_TYPE, d->type);
+        chunk_u32arr_add(&next_chunk, CHUNK_ID_UIDS, path, d->path_len + 1);
+        p->header.data_sz = (uint32_t)next_chunk - (uint32_t)p->data;
+        uint32_t pack_size = aura_pack_size(p);
+        // Ответы не вытесняют другие: ждут, пока в очереди порта будет место
+        if (!send_fifo_is_fit(&send_fifos[d->port], pack_size)) {
+            return;
+        }
+        p->header.cnt = cnt_send_pack++;
+        p->header.uid_src = d->uid;
+        p->header.uid_dest = topo_replay.uid_master;
+        p->header.cmd = CMD_ANS_WHOAMI;
+        crc16_add2pack(p, pack_size);
+        send_resp_push(d->port, p, pack_size);
+        topo_replay.idx++;
+        aura_stat.whoami_cached++;
+    }
+}
+
+static void route_work_aging(void)
+{
+    uint32_t ms = uart_get_ms();
+    if (ms - aura_sec_ms >= 1000) {
+        aura_sec_ms += 1000;
+        aura_sec++;
+    }
+    struct dict *m = map;
+    if ((route_age_sec == 0) || (m->count == 0)) {
+        return;
+    }
+    for (uint32_t n = 0; n < AURA_ROUTE_AGE_STEP; n++) {
+        uint32_t idx = route_age_idx;
+        route_age_idx = (idx + 1) & m->mask;
+        struct keyvalue *kv = &m->kvs[idx];
+        if (kv->key == DICT_KEY_EMPTY) {
+            continue;
+        }
+        uint32_t age = (aura_sec - (kv->value >> 8)) & ROUTE_SEC_MASK;
+        if (age >= route_age_sec) {
+            __disable_irq();
+            dict_del_idx(m, idx);
+            __enable_irq();
+            topo->is_valid = 0;
+            aura_stat.route_aged++;
+        }
+    }
+}
+
+#ifdef AURA_V2
+// Адрес устройства, пропавшего из таблицы маршрутов (устарел или не
+// ответил при опросе), освобождается
+static void link_addr_work(void)
+{
+    for (uint32_t n = 0; n < AURA_ROUTE_AGE_STEP; n++) {
+        uint32_t addr = link_addr_age_idx;
+        link_addr_age_idx = (addr + 1 < link_addr_next) ? addr + 1 : LINK_ADDR_FIRST;
+        uint32_t uid = link_uids[addr];
+        if ((uid == 0) || (route_get_port(uid) != -1U)) {
+            continue;
+        }
+        __disable_irq();
+        dict_del(link_addrs, uid);
+        link_uids[addr] = 0;
+        __enable_irq();
+        link_addr_gen++;
+    }
+}
+#endif
+
+static uint32_t poll_count(void)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < AURA_POLL_MAX; i++) {
+        count += (polls[i].uid != 0);
+    }
+    return count;
+}
+
+static struct poll_entry *poll_find(uint32_t uid, uint32_t cmd)
+{
+    for (uint32_t i = 0; i < AURA_POLL_MAX; i++) {
+        if ((polls[i].uid == uid) && (polls[i].cmd == cmd)) {
+            return &polls[i];
+        }
+    }
+    return 0;
+}
+
+// Запись расписания для запроса без параметров к устройству
+static struct poll_entry *poll_req_find(const struct pack *req)
+{
+    if ((req->header.uid_dest == 0)
+        || (req->header.data_sz != 0)
+        || (req->header.cmd == CMD_REQ_WRITE)) {
+        return 0;
+    }
+    return poll_find(req->header.uid_dest, req->header.cmd);
+}
+
+static uint32_t poll_is_fresh(const struct poll_entry *e)
+{
+    return e->is_cached && (uart_get_ms() - e->cache_ms <= poll_ttl_ms);
+}
+
+#ifdef AURA_CUT_THROUGH
+static struct pack *aura_cut_through_begin(struct pack *p)
+{
+    // Очередь не пуста или main еще пересылает: иначе нарушится порядок
+    // посылок или запрос порта будет занят дважды
+    if ((p->header.uid_dest == 0)
+        || (p->header.uid_dest == pack_ans.header.uid_src)
+        || (p->header.cmd & CMD_FLAG_SRC_ROUTE)
+        || aura_is_crc32(0)
+        || fifo_is_nonempty(master_fifo)
+        || aura_flag_master_work) {
+        return p;
+    }
+    // На запрос из расписания main ответит из кэша
+    struct poll_entry *e = poll_req_find(p);
+    if ((e != 0) && poll_is_fresh(e)) {
+        return p;
+    }
+    uint32_t port = route_get_port(p->header.uid_dest);
+    if ((port == -1U) || aura_is_crc32(port)) {
+        return p;
+    }
+    struct uart *dst = &uarts[port];
+    if (uart_tx_is_busy(dst)
+        || port_req_oldest(dst->num, REQ_STATE_QUEUED)
+        || port_is_waiting(dst->num)) {
+        return p;
+    }
+    struct port_req *r = port_req_alloc(dst->num, aura_req_prio(p));
+    if (r == 0) {
+        return p;
+    }
+    // Остаток посылки принимается сразу в буфер запроса порта
+    r->state = REQ_STATE_SENDING;
+    struct pack *tx = &r->pack;
+    memcpy_u8(p, tx, sizeof(struct header));
+    cut_through.dst = dst;
+    cut_through.req = r;
+    cut_through.sent = sizeof(struct header);
+    cut_through.size = sizeof(struct header) + p->header.data_sz;
+    master_rx_pack = tx;
+    uart_send_begin(dst, tx, sizeof(struct header));
+    uart_recv_poll(&uarts[0], 1);
+    return tx;
+}
+
+static void aura_cut_through_data(struct uart *u)
+{
+    // CRC придерживается до проверки
+    uint32_t received = (uint32_t)u->rx.data - (uint32_t)master_rx_pack;
+    if (received > cut_through.size) {
+        received = cut_through.size;
+    }
+    if (received > cut_through.sent) {
+        uart_send_append(cut_through.dst, received - cut_through.sent);
+        cut_through.sent = received;
+    }
+}
+
+static void aura_cut_through_end(uint32_t is_valid)
+{
+    struct uart *dst = cut_through.dst;
+    if (is_valid) {
+        uint32_t pack_size = cut_through.size + sizeof(crc16_t);
+        uart_send_append(dst, pack_size - cut_through.sent);
+        uart_send_end(dst);
+        aura_stat.master_rx++;
+        aura_stat.cut_through++;
+        aura_send_delay_start();
+    } else {
+        // Обрезанная посылка не пройдет проверку CRC у получателя
+        uart_send_abort(dst);
+        cut_through.req->state = REQ_STATE_FREE;
+        aura_stat.cut_through_abort++;
+    }
+    cut_through.dst = 0;
+    uart_recv_poll(&uarts[0], 0);
+    master_rx_pack = &master_packs[master_rx_idx];
+}
+#endif
+
+static void aura_forward(uint32_t num, const struct pack *req, uint32_t size)
+{
+    // Вытесняемый запрос может забираться на передачу из прерывания
+    __disable_irq();
+    struct port_req *r = port_req_alloc(num, aura_req_prio(req));
+    __enable_irq();
+    if (r == 0) {
+        port_stats[num].drop++;
+        aura_busy(req->header.uid_src, req->header.uid_dest);
+        return;
+    }
+    // Копия нужна, чтобы буфер мастера освободился до конца передачи
+    memcpy_u8((void *)req, &r->pack, size);
+    __disable_irq();
+    r->state = REQ_STATE_QUEUED;
+    uint32_t depth = port_req_count(num, REQ_STATE_QUEUED);
+    port_send_next(num);
+    __enable_irq();
+    if (depth > port_stats[num].depth_max) {
+        port_stats[num].depth_max = depth;
+    }
+}
+
+// Посылка с CMD_FLAG_SRC_ROUTE без верного CHUNK_ID_SRC_ROUTE в начале
+// данных никуда не пересылается
+static uint32_t src_route_is_valid(const struct pack *p)
+{
+    const struct chunk_src_route *c = (const struct chunk_src_route *)p->data;
+    return (p->header.data_sz >= sizeof(c->hdr))
+        && (p->header.data_sz >= sizeof(c->hdr) + c->hdr.size)
+        && (c->hdr.id == CHUNK_ID_SRC_ROUTE)
+        && (c->hdr.size != 0);
+}
+
+// Снимает свой порт из маршрута посылки. Последний расширитель убирает
+// маршрут целиком, и дальше идет обычная посылка. -1U - посылка
+// адресована этому расширителю. Маршрут проверен src_route_is_valid
+static uint32_t src_route_pop(struct pack *p)
+{
+    struct chunk_src_route *c = (struct chunk_src_route *)p->data;
+    uint32_t chunk_size = sizeof(c->hdr) + c->hdr.size;
+    uint32_t port = c->ports[0];
+    uint32_t size = sizeof(struct header) + p->header.data_sz;
+    crc16_t crc = crc16_get(p, size);
+    uint8_t ports[AURA_MAX_DATA_SIZE];
+    memcpy_u8(c->ports, ports, c->hdr.size);
+    for (uint32_t i = 1; i < c->hdr.size; i++) {
+        c->ports[i - 1] = c->ports[i];
+    }
+    c->ports[c->hdr.size - 1] = SRC_ROUTE_END;
+    if ((port == 0) || (port >= UART_COUNT)) {
+        port = -1U;
+    }
+    if ((port == -1U) || (c->ports[0] == SRC_ROUTE_END)) {
+        // Данные сдвигаются целиком, так что и CRC считается заново
+        p->header.data_sz -= chunk_size;
+        if (p->header.data_sz != 0) {
+            memcpy_u8(&p->data[chunk_size], p->data, p->header.data_sz);
+        }
+        p->header.cmd &= ~CMD_FLAG_SRC_ROUTE;
+        crc16_add2pack(p, aura_pack_size(p));
+        return port;
+    }
+    crc = crc16_patch(crc, size, (uint32_t)c->ports - (uint32_t)p,
+                      ports, c->ports, c->hdr.size);
+    crc16_set(p, size, crc);
+    return port;
+}
+
+static void aura_master_pack_received(void)
+{
+#ifdef AURA_CUT_THROUGH
+    if (cut_through.dst) {
+        aura_cut_through_end(1);
+        return;
+    }
+#endif
+    aura_stat.master_rx++;
+    struct pack *p = &master_packs[master_rx_idx];
+    // Пересылка по маршруту источника сразу из прерывания, если
+    // впереди в очереди ничего нет
+    if ((p->header.cmd & CMD_FLAG_SRC_ROUTE)
+        && src_route_is_valid(p)
+        && fifo_is_empty(master_fifo)
+        && !aura_flag_master_work) {
+        uint32_t port = src_route_pop(p);
+        if (port != -1U) {
+            aura_forward(port, p, aura_pack_size(p));
+            aura_stat.src_routed++;
+            aura_send_delay_start();
+            return;
+        }
+    }
+    if (fifo_is_full(master_fifo)) {
+        // Буфер приема остается тем же и будет перезаписан
+        aura_stat.master_drop++;
+        aura_busy(p->header.uid_src, p->header.uid_dest);
+        return;
+    }
+    fifo_push(master_fifo, (uint32_t)&master_packs[master_rx_idx]);
+    master_rx_idx = (master_rx_idx + 1) % arr_len(master_packs);
+}
+
+static void aura_recv_continue(uint32_t num, uint32_t have);
+
+static void aura_recv_package(uint32_t num)
+{
+    if (num == 0) {
+        master_rx_pack = &master_packs[master_rx_idx];
+    }
+    crcs_rx[num] = 0xFFFF;
+    aura_recv_continue(num, 0);
+}
+
+static void aura_recv_error(uint32_t num)
+{
+#ifdef AURA_CUT_THROUGH
+    if ((num == 0) && cut_through.dst) {
+        aura_cut_through_end(0);
+    }
+#endif
+#ifdef AURA_AUTOBAUD
+    if ((num != 0) || (autobaud_errors_max == 0)) {
+        return;
+    }
+    if (++autobaud_errors >= autobaud_errors_max) {
+        autobaud_errors = 0;
+        uart_stop_recv(&uarts[0]);
+#ifdef AURA_V2
+        aura_v2_reset();
+#endif
+        autobaud_start();
+    }
+#else
+    (void)num;
+#endif
+}
+
+static void aura_recv_ok(uint32_t num)
+{
+#ifdef AURA_AUTOBAUD
+    if (num == 0) {
+        autobaud_errors = 0;
+    }
+#else
+    (void)num;
+#endif
+}
+
+// Первое смещение от from, с которого байты совпадают с началом
+// AURA_PROTOCOL (у конца буфера - с его частью); size - не найдено.
+// Первый байт магического слова ищется сразу в 4 байтах
+static uint32_t aura_magic_find(const uint8_t *buf, uint32_t from, uint32_t size)
+{
+    const uint32_t first = (uint8_t)AURA_PROTOCOL * 0x01010101U;
+    uint32_t i = from;
+
+    while (i < size) {
+        if (size - i >= sizeof(uint32_t)) {
+            uint32_t x = __UNALIGNED_UINT32_READ(&buf[i]) ^ first;
+#if defined(__ARM_FEATURE_SIMD32)
+            // GE[n] = 1 для ненулевых байт, __SEL оставляет 0x80 в нулевых
+            __USUB8(x, 0x01010101U);
+            uint32_t zeros = __SEL(0, 0x80808080U);
+#else
+            uint32_t zeros = (x - 0x01010101U) & ~x & 0x80808080U;
+#endif
+            if (zeros == 0) {
+                i += sizeof(uint32_t);
+                continue;
+            }
+            i += __CLZ(__RBIT(zeros)) / 8;
+        } else if (buf[i] != (uint8_t)AURA_PROTOCOL) {
+            i++;
+            continue;
+        }
+        uint32_t n = size - i;
+        uint32_t j = 1;
+        if (n > sizeof(uint32_t)) {
+            n = sizeof(uint32_t);
+        }
+        while ((j < n) && (buf[i + j] == (uint8_t)(AURA_PROTOCOL >> (8 * j)))) {
+            j++;
+        }
+        if (j == n) {
+            return i;
+        }
+        i++;
+    }
+    return size;
+}
+
+// Принятое с начала буфера - не посылка: остаток с ближайшего
+// магического слова переносится в начало. Возвращает его длину
+static uint32_t aura_recv_resync(uint32_t num, uint32_t size)
+{
+    uint8_t *buf = (uint8_t *)aura_rx_pack(num);
+    uint32_t k = aura_magic_find(buf, 1, size);
+    if (aura_is_v2(num)) {
+        for (uint32_t i = 1; i < k; i++) {
+            if (buf[i] == AURA_V2_MAGIC) {
+                k = i;
+                break;
+            }
+        }
+    }
+    uint32_t have = size - k;
+    if (have != 0) {
+        memcpy_u8(&buf[k], buf, have);
+    }
+    crcs_rx[num] = crc16_calc_continue(0xFFFF, buf, have);
+    aura_stat.rx_resync++;
+    return have;
+}
+
+static uint32_t aura_header_is_valid(const struct pack *p)
+{
+    return (p->header.protocol == AURA_PROTOCOL)
+        && (p->header.data_sz <= sizeof(p->data));
+}
+
+static uint32_t aura_rx_is_v2(uint32_t num, const struct pack *p)
+{
+    return aura_is_v2(num) && (((const uint8_t *)p)[0] == AURA_V2_MAGIC);
+}
+
+// Посылка принята целиком. 0 - неверная CRC
+static uint32_t aura_recv_done(uint32_t num, struct pack *p)
+{
+    if (!aura_crc_check(num, p, rx_body[num])) {
+        aura_recv_error(num);
+        return 0;
+    }
+#ifdef AURA_V2
+    if (aura_rx_is_v2(num, p)
+        && !aura_v2_decode(p, rx_body[num] - v2_data_sz((uint8_t *)p))) {
+        // Посылка цела, но адресат неизвестен: она теряется без поиска
+        aura_recv_package(num);
+        return 1;
+    }
+#endif
+    if (num == 0) {
+        aura_master_pack_received();
+    } else if (fifo_is_full(slave_fifo(num))) {
+        // Буфер приема остается тем же и будет перезаписан
+        port_stats[num].rx_drop++;
+    } else {
+        fifo_push(slave_fifo(num), (uint32_t)p);
+        slave_rx_idx[num] = (slave_rx_idx[num] + 1) % arr_len(slave_packs[num]);
+    }
+    aura_recv_ok(num);
+    aura_recv_package(num);
+    return 1;
+}
+
+// В буфере приема have байт, начиная с магического слова. Заголовок
+// проверяется до того, как верить data_sz; после ошибки прием
+// продолжается со следующего AURA_PROTOCOL внутри уже принятого.
+// На линии v2 версия видна по первому байту, поэтому сначала
+// принимается заголовок v2 наименьшей длины
+static void aura_recv_continue(uint32_t num, uint32_t have)
+{
+    struct uart *u = &uarts[num];
+    struct pack *p = aura_rx_pack(num);
+
+    while (1) {
+#ifdef AURA_AUTOBAUD
+        // Пока RX USART1 подключен к таймеру, прием не запускаем
+        if ((num == 0) && autobaud_is_running()) {
+            return;
+        }
+#endif
+        uint32_t is_v2 = (have != 0) && aura_rx_is_v2(num, p);
+        uint32_t hdr_size = sizeof(struct header);
+#ifdef AURA_V2
+        if (is_v2) {
+            hdr_size = v2_header_size((uint8_t *)p, have);
+        } else if (aura_is_v2(num) && (have == 0)) {
+            hdr_size = AURA_V2_HDR_MIN;
+        }
+#endif
+        if ((hdr_size != 0) && (have < hdr_size)) {
+            states_recv[num] = STATE_RECV_START;
+            uart_recv_array(u, (uint8_t *)p + have, hdr_size - have);
+            return;
+        }
+        uint32_t data_sz = 0;
+#ifdef AURA_V2
+        if (is_v2) {
+            data_sz = (hdr_size != 0) ? v2_data_sz((uint8_t *)p) : -1U;
+        } else
+#endif
+        {
+            data_sz = aura_header_is_valid(p) ? p->header.data_sz : -1U;
+        }
+        if (data_sz > sizeof(p->data)) {
+            have = aura_recv_resync(num, have);
+            continue;
+        }
+        uint32_t body = hdr_size + data_sz;
+        uint32_t size = body + aura_crc_size(num);
+        rx_body[num] = body;
+        states_recv[num] = STATE_RECV_HEADER;
+        if (aura_is_crc32(num) && (have > body)) {
+            crcs_rx[num] = crc16_calc_continue(0xFFFF, p, body);
+        } else if (have > size) {
+            // CRC после поиска захватила и байты за посылкой
+            crcs_rx[num] = crc16_calc_continue(0xFFFF, p, size);
+        }
+        if (have < size) {
+#ifdef AURA_CUT_THROUGH
+            if ((num == 0) && !is_v2 && (have == sizeof(struct header))) {
+                p = aura_cut_through_begin(p);
+            }
+#endif
+            uart_recv_array(u, (uint8_t *)p + have, size - have);
+            return;
+        }
+        // Посылка уже целиком в буфере, байты за ней теряются
+        if (aura_recv_done(num, p)) {
+            return;
+        }
+        have = aura_recv_resync(num, size);
+    }
+}
+
+// period_ms 0 - устройство убирается из расписания
+static void poll_set(const struct chunk_poll *c)
+{
+    struct poll_entry *e = poll_find(c->uid, c->cmd);
+    if (c->period_ms == 0) {
+        if (e != 0) {
+            e->uid = 0;
+        }
+        return;
+    }
+    for (uint32_t i = 0; (e == 0) && (i < AURA_POLL_MAX); i++) {
+        if (polls[i].uid == 0) {
+            e = &polls[i];
+            e->uid = c->uid;
+            e->cmd = c->cmd;
+            e->is_pending = 0;
+            e->is_cached = 0;
+            e->ms = uart_get_ms() - c->period_ms;
+        }
+    }
+    if (e == 0) {
+        return;
+    }
+    e->period_ms = c->period_ms;
+}
+
+// Ответ устройства на запрос из расписания кэшируется, чей бы запрос
+// это ни был. 1 - ответ на запрос самого расширителя, дальше он не идет
+static uint32_t poll_store(const struct pack *p)
+{
+    if ((p->header.uid_src == 0) || (p->header.cmd == CMD_NONE)) {
+        return 0;
+    }
+    // Ответ на команду cmd приходит с командой cmd + 1
+    struct poll_entry *e = poll_find(p->header.uid_src, p->header.cmd - 1);
+    if (e == 0) {
+        return 0;
+    }
+    e->cache_ms = uart_get_ms();
+    e->cache_cnt = p->header.cnt;
+    e->cache_cmd = p->header.cmd;
+    e->cache_sz = p->header.data_sz;
+    if (p->header.data_sz != 0) {
+        memcpy_u8((void *)p->data, e->cache, p->header.data_sz);
+    }
+    e->is_cached = 1;
+    if (e->is_pending && (p->header.uid_dest == pack_ans.header.uid_src)) {
+        e->is_pending = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Запрос без параметров к устройству из расписания обслуживается из кэша,
+// если ответ моложе poll_ttl_ms. Возраст ответа - в CHUNK_ID_POLL_AGE_MS
+static uint32_t poll_answer(const struct pack *req)
+{
+    struct poll_entry *e = poll_req_find(req);
+    if (e == 0) {
+        return 0;
+    }
+    uint32_t age_ms = uart_get_ms() - e->cache_ms;
+    if (!poll_is_fresh(e)) {
+        aura_stat.poll_miss++;
+        return 0;
+    }
+    struct pack *p = &pack_poll;
+    p->header.cnt = e->cache_cnt;
+    p->header.uid_src = e->uid;
+    p->header.uid_dest = req->header.uid_src;
+    p->header.cmd = e->cache_cmd;
+    p->header.data_sz = e->cache_sz;
+    if (e->cache_sz != 0) {
+        memcpy_u8(e->cache, p->data, e->cache_sz);
+    }
+    if (e->cache_sz + sizeof(struct chunk_u16) <= AURA_MAX_DATA_SIZE) {
+        void *next_chunk = &p->data[e->cache_sz];
+        chunk_u16_add(&next_chunk, CHUNK_ID_POLL_AGE_MS, age_ms);
+        p->header.data_sz += sizeof(struct chunk_u16);
+    }
+    uint32_t pack_size = aura_pack_size(p);
+    crc16_add2pack(p, pack_size);
+    send_resp_push(0, p, pack_size);
+    aura_stat.poll_hit++;
+    return 1;
+}
+
+// Запросы расписания идут от имени расширителя и только в свободный порт:
+// запросы мастера их не ждут, и ответ на запрос мастера не перепутается
+// с ответом на запрос расписания
+static void poll_work(void)
+{
+    uint32_t ms = uart_get_ms();
+    for (uint32_t i = 0; i < AURA_POLL_MAX; i++) {
+        struct poll_entry *e = &polls[i];
+        if ((e->uid == 0) || (ms - e->ms < e->period_ms)) {
+            continue;
+        }
+        uint32_t port = route_get_port(e->uid);
+        if ((port == -1U)
+            || (port_req_count(port, REQ_STATE_QUEUED) != 0)
+            || (port_req_count(port, REQ_STATE_SENDING) != 0)
+            || (port_req_count(port, REQ_STATE_WAIT) != 0)
+            || (port_req_count(port, REQ_STATE_FREE) == 0)) {
+            continue;
+        }
+        struct pack *p = &pack_poll;
+        p->header.cnt = cnt_send_pack++;
+        p->header.uid_src = pack_ans.header.uid_src;
+        p->header.uid_dest = e->uid;
+        p->header.cmd = e->cmd;
+        p->header.data_sz = 0;
+        uint32_t pack_size = aura_pack_size(p);
+        crc16_add2pack(p, pack_size);
+        aura_forward(port, p, pack_size);
+        e->ms = ms;
+        e->is_pending = 1;
+        aura_stat.poll_sent++;
+    }
+}
+
+// Текущий ответ pack_ans переключает линию с мастером
+static void switch_ack_arm(void)
+{
+    switch_ack_cnt = pack_ans.header.cnt;
+    aura_flag_switch_ack = 1;
+}
+
+static uint32_t ans_has_space(void *next_ans_chunk, uint32_t size)
+{
+    return (uint32_t)next_ans_chunk + size
+        <= (uint32_t)&pack_ans.data[AURA_MAX_DATA_SIZE];
+}
+
+static void chunk_uart_cfg_add(void **next_chunk, uint32_t port,
+                               const struct uart_cfg *cfg)
+{
+    struct chunk_uart_cfg *c = (struct chunk_uart_cfg *)*next_chunk;
+    c->hdr.id = CHUNK_ID_UART_CFG;
+    c->hdr.type = CHUNK_TYPE_ARR_U8;
+    c->hdr.size = sizeof(*c) - sizeof(c->hdr);
+    c->port = port;
+    c->parity = cfg->parity;
+    c->stop_bits = cfg->stop_bits;
+    c->over8 = cfg->over8;
+    c->baudrate = cfg->baudrate;
+    *next_chunk = (void *)((uint32_t)*next_chunk + sizeof(*c));
+}
+
+static void cmd_write_uart_cfg(const struct chunk_uart_cfg *c, void **next_ans_chunk)
+{
+    if ((c->port >= UART_COUNT)
+        || !ans_has_space(*next_ans_chunk, sizeof(struct chunk_uart_cfg))) {
+        return;
+    }
+    struct uart_cfg cfg = {
+        .baudrate = c->baudrate,
+        .parity = c->parity,
+        .stop_bits = c->stop_bits,
+        .over8 = c->over8,
+    };
+    struct uart *u = &uarts[c->port];
+    if (!uart_cfg_is_valid(&cfg)) {
+        chunk_uart_cfg_add(next_ans_chunk, c->port, &u->cfg);
+    } else if (c->port == 0) {
+        // Ответ мастеру уходит на старой скорости, новая - после передачи
+        uart0_cfg_pending = cfg;
+        aura_flag_uart0_cfg = 1;
+        switch_ack_arm();
+        chunk_uart_cfg_add(next_ans_chunk, c->port, &cfg);
+    } else {
+        uart_set_cfg(u, &cfg);
+        chunk_uart_cfg_add(next_ans_chunk, c->port, &u->cfg);
+    }
+}
+
+static void cmd_write_data(const struct pack *req, void **next_ans_chunk)
+{
+    int32_t req_data_size = req->header.data_sz;
+    void *next_req_chunk = (void *)req->data;
+
+    while (req_data_size > 0) {
+        struct chunk_hdr *hdr = (struct chunk_hdr *)next_req_chunk;
+        uint32_t chunk_size = hdr->size + sizeof(struct chunk_hdr);
+        next_req_chunk = (void *)((uint32_t)next_req_chunk + chunk_size);
+        req_data_size -= chunk_size;
+
+        switch (hdr->id) {
+        case CHUNK_ID_RELAY1_STATUS:
+        case CHUNK_ID_RELAY2_STATUS: {
+            enum relay relay = (hdr->id == CHUNK_ID_RELAY1_STATUS) ? RELAY1 : RELAY2;
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            if (c->val == 0x00FF) {
+                relay_open(relay);
+            } else if (c->val == 0x0000) {
+                relay_close(relay);
+            }
+            uint16_t data = relay_is_open(relay) ? 0x00FF : 0x0000;
+            chunk_u16_add(next_ans_chunk, hdr->id, data);
+        } break;
+        case CHUNK_ID_UART_IRQ_COUNT:
+        case CHUNK_ID_UART_IRQ_CYCLES: {
+            uart_stat_reset();
+        } break;
+        case CHUNK_ID_AURA_STAT: {
+            aura_stat = (struct aura_stat){0};
+        } break;
+        case CHUNK_ID_PORT_STAT: {
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            if ((c->val != 0) && (c->val < UART_COUNT)) {
+                port_stats[c->val] = (struct port_stat){0};
+            }
+        } break;
+        case CHUNK_ID_SCHED_WEIGHTS: {
+            // Веса очередей ответов по портам, 0 - порт не меняется
+            struct chunk_u32arr *c = (struct chunk_u32arr *)hdr;
+            uint32_t count = hdr->size / sizeof(uint32_t);
+            if (count > UART_COUNT) {
+                count = UART_COUNT;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (c->arr[i] != 0) {
+                    sched.weights[i] = (c->arr[i] > AURA_SCHED_WEIGHT_MAX)
+                                       ? AURA_SCHED_WEIGHT_MAX
+                                       : c->arr[i];
+                }
+            }
+            if (ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(sched.weights))) {
+                chunk_u32arr_add(next_ans_chunk, hdr->id, sched.weights, UART_COUNT);
+            }
+        } break;
+        case CHUNK_ID_SCHED_HOL_MS: {
+            arr_clear_u32(sched.hol_ms_max, UART_COUNT);
+        } break;
+        case CHUNK_ID_SEND_POLICY: {
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            if (c->val <= SEND_POLICY_PRIO) {
+                send_policy = (enum send_policy)c->val;
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, send_policy);
+        } break;
+        case CHUNK_ID_SEND_DROP: {
+            arr_clear_u32(send_drops, UART_COUNT);
+        } break;
+        case CHUNK_ID_DUP_SUPPRESSED: {
+            arr_clear_u32(dup_suppressed, UART_COUNT);
+        } break;
+#ifdef AURA_CONTAINER
+        case CHUNK_ID_COALESCE_MS: {
+            // 0 - ответы не ждут попутчиков, но контейнер из уже
+            // накопленных собирается
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            coalesce_ms = (c->val > AURA_COALESCE_MS_MAX) ? AURA_COALESCE_MS_MAX : c->val;
+            chunk_u16_add(next_ans_chunk, hdr->id, coalesce_ms);
+        } break;
+        case CHUNK_ID_CONTAINER_MTU: {
+            // Мастер, понимающий CMD_ANS_CONTAINER, сообщает, какой размер
+            // данных он принимает; 0 - контейнеры выключены
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            container_mtu = (c->val > AURA_CONTAINER_MTU) ? AURA_CONTAINER_MTU : c->val;
+            chunk_u16_add(next_ans_chunk, hdr->id, container_mtu);
+        } break;
+#endif
+        case CHUNK_ID_POLL: {
+            // Ответ - число устройств в расписании после изменения
+            if (hdr->size == sizeof(struct chunk_poll) - sizeof(struct chunk_hdr)) {
+                poll_set((struct chunk_poll *)hdr);
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, poll_count());
+        } break;
+        case CHUNK_ID_POLL_TTL_MS: {
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            poll_ttl_ms = c->val;
+            chunk_u16_add(next_ans_chunk, hdr->id, poll_ttl_ms);
+        } break;
+#ifdef AURA_V2
+        case CHUNK_ID_FRAME_V2: {
+            // 1 - заголовок v2 на линии с мастером, после передачи ответа.
+            // Адрес LINK_ADDR_PEER - uid мастера, приславшего запрос
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            v2_peer_uid = req->header.uid_src;
+            v2_link_pending = (c->val != 0);
+            aura_flag_v2_link = 1;
+            switch_ack_arm();
+            chunk_u16_add(next_ans_chunk, hdr->id, v2_link_pending);
+        } break;
+#endif
+#ifdef AURA_CRC32
+        case CHUNK_ID_FRAME_CRC32: {
+            // Бит n - порт n закрывает посылки crc32. Остальные порты
+            // меняются сразу, USART1 - после передачи ответа
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            uint32_t mask = c->val & ((1U << UART_COUNT) - 1);
+            __disable_irq();
+            crc32_ports = (crc32_ports & 1U) | (mask & ~1U);
+            __enable_irq();
+            crc32_ports_pending = mask;
+            aura_flag_crc32_ports = 1;
+            switch_ack_arm();
+            chunk_u16_add(next_ans_chunk, hdr->id, mask);
+        } break;
+#endif
+        case CHUNK_ID_ROUTE_AGE: {
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            route_age_sec = c->val;
+            chunk_u16_add(next_ans_chunk, hdr->id, route_age_sec);
+        } break;
+        case CHUNK_ID_WHOAMI_CACHE: {
+            // 1 - отвечать на широковещательный WHOAMI из кэша топологии
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            whoami_cache = (c->val != 0);
+            chunk_u16_add(next_ans_chunk, hdr->id, whoami_cache);
+        } break;
+        case CHUNK_ID_UART_CFG: {
+            if (hdr->size == sizeof(struct chunk_uart_cfg) - sizeof(struct chunk_hdr)) {
+                cmd_write_uart_cfg((struct chunk_uart_cfg *)hdr, next_ans_chunk);
+            }
+        } break;
+#ifdef AURA_AUTOBAUD
+        case CHUNK_ID_AUTOBAUD: {
+            // Порог ошибок приема до повторного определения, 0 - выключено
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            autobaud_errors_max = c->val;
+            autobaud_errors = 0;
+            chunk_u16_add(next_ans_chunk, hdr->id, autobaud_errors_max);
+        } break;
+#endif
+        default: {
+        } break;
+        }
+    }
+}
 
-enum device_type {
-    DEVICE_TYPE_LB75BD = 1,
-    DEVICE_TYPE_TMP112,
-    DEVICE_TYPE_SHT30,
-    DEVICE_TYPE_ZS05,
-    DEVICE_TYPE_BMP180,
-    DEVICE_TYPE_LPS22HB,
-    DEVICE_TYPE_DOORKNOT,
-    DEVICE_TYPE_EXPANDER,
-    DEVICE_TYPE_WETSENS,
-};
+static void cmd_read_data(const struct pack *req, void **next_ans_chunk)
+{
+    int32_t req_data_size = req->header.data_sz;
+    void *next_req_chunk = (void *)req->data;
+    uint32_t vals[UART_COUNT];
 
-struct header {
-    const uint32_t protocol;
-    uint32_t cnt;
-    uint32_t uid_src;
-    uint32_t uid_dest;
-    uint16_t cmd;
-    uint16_t data_sz;
-};
+    while (req_data_size > 0) {
+        struct chunk_hdr *hdr = (struct chunk_hdr *)next_req_chunk;
+        uint32_t chunk_size = hdr->size + sizeof(struct chunk_hdr);
+        next_req_chunk = (void *)((uint32_t)next_req_chunk + chunk_size);
+        req_data_size -= chunk_size;
 
-struct __PACKED pack {
-    struct header header;
-    uint8_t data[AURA_MAX_DATA_SIZE];
-    crc16_t crc;
-};
+        switch (hdr->id) {
+        case CHUNK_ID_UART_IRQ_COUNT:
+        case CHUNK_ID_UART_IRQ_CYCLES: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(vals))) {
+                return;
+            }
+            for (uint32_t i = 0; i < UART_COUNT; i++) {
+                vals[i] = (hdr->id == CHUNK_ID_UART_IRQ_COUNT)
+                            ? uarts[i].stat.irq_count
+                            : uarts[i].stat.irq_cycles;
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, vals, UART_COUNT);
+        } break;
+        case CHUNK_ID_AURA_STAT: {
+            uint32_t count = sizeof(aura_stat) / sizeof(uint32_t);
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(aura_stat))) {
+                return;
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, (uint32_t *)&aura_stat, count);
+        } break;
+        case CHUNK_ID_PORT_STAT: {
+            // Запрос: chunk_u16 с номером порта
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            uint32_t count = sizeof(struct port_stat) / sizeof(uint32_t);
+            if ((c->val == 0) || (c->val >= UART_COUNT)) {
+                break;
+            }
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(struct port_stat))) {
+                return;
+            }
+            port_stats[c->val].depth = port_req_count(c->val, REQ_STATE_QUEUED);
+            chunk_u32arr_add(next_ans_chunk, hdr->id, (uint32_t *)&port_stats[c->val], count);
+        } break;
+#ifdef AURA_CONTAINER
+        case CHUNK_ID_COALESCE_MS: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_u16))) {
+                return;
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, coalesce_ms);
+        } break;
+        case CHUNK_ID_CONTAINER_MTU: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_u16))) {
+                return;
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, container_mtu);
+        } break;
+#endif
+#ifdef AURA_CRC32
+        case CHUNK_ID_FRAME_CRC32: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_u16))) {
+                return;
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, crc32_ports);
+        } break;
+#endif
+#ifdef AURA_V2
+        case CHUNK_ID_FRAME_V2: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_u16))) {
+                return;
+            }
+            chunk_u16_add(next_ans_chunk, hdr->id, v2_link);
+        } break;
+        case CHUNK_ID_LINK_ADDRS: {
+            // Запрос: chunk_u16 с первым адресом. Ответ: поколение таблицы,
+            // этот адрес и uid устройств с адресами подряд, сколько
+            // поместится; 0 - адрес свободен. Если поколение сменилось,
+            // мастер перечитывает таблицу целиком
+            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
+            uint32_t uids[AURA_MAX_DATA_SIZE / sizeof(uint32_t)];
+            uint32_t first = (c->val < LINK_ADDR_FIRST) ? LINK_ADDR_FIRST : c->val;
+            uint32_t count = (first < link_addr_next) ? link_addr_next - first : 0;
+            uint32_t space = (uint32_t)&pack_ans.data[AURA_MAX_DATA_SIZE]
+                           - (uint32_t)*next_ans_chunk;
+            if (space < sizeof(struct chunk_hdr) + 2 * sizeof(uint32_t)) {
+                return;
+            }
+            uint32_t count_max = (space - sizeof(struct chunk_hdr)) / sizeof(uint32_t) - 2;
+            if (count > count_max) {
+                count = count_max;
+            }
+            uids[0] = link_addr_gen;
+            uids[1] = first;
+            for (uint32_t i = 0; i < count; i++) {
+                uids[i + 2] = link_uids[first + i];
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, uids, count + 2);
+        } break;
+#endif
+        case CHUNK_ID_SEND_POLICY:
+        case CHUNK_ID_ROUTE_AGE:
+        case CHUNK_ID_WHOAMI_CACHE:
+        case CHUNK_ID_POLL:
+        case CHUNK_ID_POLL_TTL_MS: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_u16))) {
+                return;
+            }
+            uint16_t val = (hdr->id == CHUNK_ID_SEND_POLICY) ? send_policy
+                         : (hdr->id == CHUNK_ID_ROUTE_AGE)   ? route_age_sec
+                         : (hdr->id == CHUNK_ID_POLL)        ? poll_count()
+                         : (hdr->id == CHUNK_ID_POLL_TTL_MS) ? poll_ttl_ms
+                                                             : whoami_cache;
+            chunk_u16_add(next_ans_chunk, hdr->id, val);
+        } break;
+        case CHUNK_ID_SEND_DROP: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(send_drops))) {
+                return;
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, send_drops, UART_COUNT);
+        } break;
+        case CHUNK_ID_DUP_SUPPRESSED: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(dup_suppressed))) {
+                return;
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, dup_suppressed, UART_COUNT);
+        } break;
+        case CHUNK_ID_SCHED_WEIGHTS:
+        case CHUNK_ID_SCHED_HOL_MS: {
+            if (!ans_has_space(*next_ans_chunk, sizeof(struct chunk_hdr) + sizeof(vals))) {
+                return;
+            }
+            // Для ждущей сейчас головы очереди учитывается и текущее ожидание
+            uint32_t ms = uart_get_ms();
+            for (uint32_t i = 0; i < UART_COUNT; i++) {
+                uint32_t hol_ms = send_fifo_is_not_empty(&send_fifos[i])
+                                  ? ms - sched.hol_ms[i]
+                                  : 0;
+                if (hdr->id == CHUNK_ID_SCHED_WEIGHTS) {
+                    vals[i] = sched.weights[i];
+                } else {
+                    vals[i] = (hol_ms > sched.hol_ms_max[i]) ? hol_ms : sched.hol_ms_max[i];
+                }
+            }
+            chunk_u32arr_add(next_ans_chunk, hdr->id, vals, UART_COUNT);
+        } break;
+        default: {
+        } break;
+        }
+    }
+}
 
-static struct __PACKED pack pack_ans = {
-    .header = {.protocol = AURA_PROTOCOL},
-};
+static void ans_data_add(void **next_ans_chunk)
+{
+    chunk_u16_add(next_ans_chunk, CHUNK_ID_WETSENS, sens_get_state());
+    chunk_u16_add(next_ans_chunk, CHUNK_ID_BAT_VOLT, bat_get_voltage());
+    chunk_u16_add(next_ans_chunk, CHUNK_ID_RELAY1_STATUS,
+                  relay_is_open(RELAY1) ? 0x00FF : 0x0000);
+    chunk_u16_add(next_ans_chunk, CHUNK_ID_RELAY2_STATUS,
+                  relay_is_open(RELAY2) ? 0x00FF : 0x0000);
+}
 
-static enum state_recv states_recv[UART_COUNT] = {0};
-static struct pack packs[UART_COUNT] __ALIGNED(8);
-static uint32_t aura_flags_pack_received[UART_COUNT] = {0};
-static uint32_t aura_flag_send_delay = 0;
-static uint32_t cnt_send_pack = 0;
+static void gather_flush(void)
+{
+    struct pack *p = &pack_gather;
+    p->header.cnt = cnt_send_pack++;
+    p->header.uid_src = pack_ans.header.uid_src;
+    p->header.uid_dest = gather.uid_master;
+    p->header.cmd = CMD_ANS_GATHER;
+    p->header.data_sz = (uint32_t)gather.next_chunk - (uint32_t)p->data;
+    uint32_t pack_size = aura_pack_size(p);
+    crc16_add2pack(p, pack_size);
+    send_resp_push(0, p, pack_size);
+    gather.next_chunk = p->data;
+}
 
-static void aura_recv_package(uint32_t num)
+static void gather_add(uint32_t uid, const void *data, uint32_t size)
 {
-    states_recv[num] = STATE_RECV_START;
-    struct uart *u = &uarts[num];
-    struct pack *p = &packs[num];
-    uart_recv_array(u, p, sizeof(struct header));
+    uint32_t chunk_size = sizeof(struct chunk_gather_dev) + size;
+    // Место под GATHER_END в последней посылке держится всегда
+    uint32_t data_max = AURA_MAX_DATA_SIZE - sizeof(struct chunk_u16);
+    if (chunk_size > data_max) {
+        aura_stat.gather_skip++;
+        return;
+    }
+    if ((uint32_t)gather.next_chunk + chunk_size > (uint32_t)&pack_gather.data[data_max]) {
+        gather_flush();
+    }
+    struct chunk_gather_dev *c = (struct chunk_gather_dev *)gather.next_chunk;
+    c->hdr.id = CHUNK_ID_GATHER_DEV;
+    c->hdr.type = CHUNK_TYPE_ARR_U8;
+    c->hdr.size = sizeof(c->uid) + size;
+    c->uid = uid;
+    if (size != 0) {
+        memcpy_u8((void *)data, c->data, size);
+    }
+    gather.next_chunk = (void *)((uint32_t)gather.next_chunk + chunk_size);
+    gather.count++;
+    aura_stat.gather_dev++;
 }
 
-static void cmd_write_data(const struct pack *req, void **next_ans_chunk)
+// Запрос: GATHER_CMD - команда для устройств, GATHER_MS - время сбора,
+// остальные chunk'и передаются устройствам без изменений
+static void gather_start(const struct pack *req)
 {
+    if (gather.is_running) {
+        aura_busy(req->header.uid_src, pack_ans.header.uid_src);
+        return;
+    }
+    struct pack *p = &pack_gather_req;
+    uint32_t cmd = CMD_REQ_DATA;
+    uint32_t deadline_ms = AURA_GATHER_MS;
     int32_t req_data_size = req->header.data_sz;
     void *next_req_chunk = (void *)req->data;
+    void *next_chunk = p->data;
 
     while (req_data_size > 0) {
         struct chunk_hdr *hdr = (struct chunk_hdr *)next_req_chunk;
@@ -96,55 +2203,176 @@ static void cmd_write_data(const struct pack *req, void **next_ans_chunk)
         req_data_size -= chunk_size;
 
         switch (hdr->id) {
-        case CHUNK_ID_RELAY1_STATUS:
-        case CHUNK_ID_RELAY2_STATUS: {
-            enum relay relay = (hdr->id == CHUNK_ID_RELAY1_STATUS) ? RELAY1 : RELAY2;
-            struct chunk_u16 *c = (struct chunk_u16 *)hdr;
-            if (c->val == 0x00FF) {
-                relay_open(relay);
-            } else if (c->val == 0x0000) {
-                relay_close(relay);
-            }
-            uint16_t data = relay_is_open(relay) ? 0x00FF : 0x0000;
-            chunk_u16_add(next_ans_chunk, hdr->id, data);
+        case CHUNK_ID_GATHER_CMD: {
+            cmd = ((struct chunk_u16 *)hdr)->val;
+        } break;
+        case CHUNK_ID_GATHER_MS: {
+            uint32_t ms = ((struct chunk_u16 *)hdr)->val;
+            deadline_ms = (ms > AURA_GATHER_MS_MAX) ? AURA_GATHER_MS_MAX : ms;
         } break;
         default: {
+            if (req_data_size >= 0) {
+                memcpy_u8(hdr, next_chunk, chunk_size);
+                next_chunk = (void *)((uint32_t)next_chunk + chunk_size);
+            }
         } break;
         }
     }
+
+    // Ответы приходят на uid расширителя и собираются в cmd_work_slave
+    p->header.cnt = cnt_send_pack++;
+    p->header.uid_src = pack_ans.header.uid_src;
+    p->header.uid_dest = 0;
+    p->header.cmd = cmd;
+    p->header.data_sz = (uint32_t)next_chunk - (uint32_t)p->data;
+    uint32_t pack_size = aura_pack_size(p);
+    crc16_add2pack(p, pack_size);
+
+    gather.uid_master = req->header.uid_src;
+    gather.ms = uart_get_ms();
+    gather.deadline_ms = deadline_ms;
+    gather.count = 0;
+    gather.next_chunk = pack_gather.data;
+    gather.is_running = 1;
+    dup_add(UART_COUNT, p);
+    for (uint32_t i = 1; i < UART_COUNT; i++) {
+        aura_forward(i, p, pack_size);
+    }
+    if (cmd == CMD_REQ_DATA) {
+        uint8_t data[4 * sizeof(struct chunk_u16)];
+        void *next_ans_chunk = data;
+        ans_data_add(&next_ans_chunk);
+        gather_add(pack_ans.header.uid_src, data, sizeof(data));
+    }
+}
+
+static void gather_work(void)
+{
+    if (!gather.is_running || (uart_get_ms() - gather.ms < gather.deadline_ms)) {
+        return;
+    }
+    gather.is_running = 0;
+    chunk_u16_add(&gather.next_chunk, CHUNK_ID_GATHER_END, gather.count);
+    gather_flush();
+}
+
+static void cmd_work_local(struct pack *req);
+
+// Каждый CHUNK_ID_BULK_REQ запроса - отдельная посылка от имени мастера
+// с cnt запроса. Посылки расходятся по очередям своих портов и
+// передаются параллельно, ответы мастеру идут как на обычные запросы
+static void bulk_start(const struct pack *req)
+{
+    struct pack *p = &pack_bulk;
+    int32_t req_data_size = req->header.data_sz;
+    void *next_req_chunk = (void *)req->data;
+
+    while (req_data_size > 0) {
+        struct chunk_bulk_req *c = (struct chunk_bulk_req *)next_req_chunk;
+        uint32_t chunk_size = c->hdr.size + sizeof(struct chunk_hdr);
+        next_req_chunk = (void *)((uint32_t)next_req_chunk + chunk_size);
+        req_data_size -= chunk_size;
+        if ((req_data_size < 0)
+            || (c->hdr.id != CHUNK_ID_BULK_REQ)
+            || (c->hdr.size < sizeof(*c) - sizeof(c->hdr))) {
+            continue;
+        }
+        uint32_t data_sz = c->hdr.size - (sizeof(*c) - sizeof(c->hdr));
+        // Вложенный BULK и широковещательный подзапрос не разворачиваются.
+        // Мастер узнает о пропуске по CMD_ANS_BUSY, не дожидаясь таймаута
+        if ((c->uid == 0) || (c->cmd == CMD_REQ_BULK)) {
+            aura_stat.bulk_skip++;
+            aura_busy(req->header.uid_src, c->uid);
+            continue;
+        }
+        p->header.cnt = req->header.cnt;
+        p->header.uid_src = req->header.uid_src;
+        p->header.uid_dest = c->uid;
+        p->header.cmd = c->cmd;
+        p->header.data_sz = data_sz;
+        if (data_sz != 0) {
+            memcpy_u8(c->data, p->data, data_sz);
+        }
+        uint32_t pack_size = aura_pack_size(p);
+        crc16_add2pack(p, pack_size);
+        aura_stat.bulk_sub++;
+
+        if (c->uid == pack_ans.header.uid_src) {
+            cmd_work_local(p);
+            continue;
+        }
+        uint32_t port = route_get_port(c->uid);
+        if (port == -1U) {
+            aura_stat.bulk_skip++;
+            aura_busy(req->header.uid_src, c->uid);
+            continue;
+        }
+        aura_forward(port, p, pack_size);
+    }
 }
 
 static void cmd_work_master()
 {
-    if (aura_flags_pack_received[0] == 0) {
+    if (fifo_is_empty(master_fifo)) {
+        return;
+    }
+    aura_send_delay_start();
+
+    aura_flag_master_work = 1;
+    struct pack *req = (struct pack *)fifo_pop(master_fifo);
+    if (req->header.cmd & CMD_FLAG_SRC_ROUTE) {
+        if (!src_route_is_valid(req)) {
+            aura_stat.src_route_bad++;
+            aura_flag_master_work = 0;
+            return;
+        }
+        uint32_t port = src_route_pop(req);
+        if (port != -1U) {
+            aura_forward(port, req, aura_pack_size(req));
+            aura_stat.src_routed++;
+            aura_flag_master_work = 0;
+            return;
+        }
+    }
+    if (poll_answer(req)) {
+        aura_flag_master_work = 0;
         return;
     }
-    #ifdef DELAY
-        LL_TIM_SetCounter(TIM7, 0);
-        aura_flag_send_delay = 1;
-    #endif
-    aura_flags_pack_received[0] = 0;
-    
-    struct pack *req = &packs[0];
     uint32_t pack_size = sizeof(req->header)
                        + req->header.data_sz
                        + sizeof(req->crc);
-    if (req->header.uid_dest == 0) {
+    if ((req->header.uid_dest == 0) && dup_check(0, req)) {
+        aura_flag_master_work = 0;
+        return;
+    }
+    uint32_t is_discovery = (req->header.uid_dest == 0)
+                            && (req->header.cmd == CMD_REQ_WHOAMI);
+    if (is_discovery && whoami_cache && topo->is_valid) {
+        // Шины не опрашиваются, устройства отвечают из кэша топологии
+        topo_replay_start(req->header.uid_src);
+    } else if (req->header.uid_dest == 0) {
+        if (is_discovery) {
+            route_discovery_start();
+        }
         for (uint32_t i = 1; i < UART_COUNT; i++) {
-            uart_send_array(&uarts[i], req, pack_size);
+            aura_forward(i, req, pack_size);
         }
     } else {
-        uint32_t idx = dict_get_idx(map, req->header.uid_dest);
-        if (idx != -1U) {
-            uint32_t uart_num = map->kvs[idx].value;
-            uart_send_array(&uarts[uart_num], req, pack_size);
+        uint32_t port = route_get_port(req->header.uid_dest);
+        if (port != -1U) {
+            aura_forward(port, req, pack_size);
         }
     }
+    aura_flag_master_work = 0;
     if ((req->header.uid_dest != 0)
         && (req->header.uid_dest != pack_ans.header.uid_src)) {
         return;
     }
+    cmd_work_local(req);
+}
 
+static void cmd_work_local(struct pack *req)
+{
     struct pack *ans = &pack_ans;
     ans->header.cnt = cnt_send_pack++;
     ans->header.uid_dest = req->header.uid_src;
@@ -154,24 +2382,36 @@ static void cmd_work_master()
 
     switch (req->header.cmd) {
     case CMD_REQ_WHOAMI: {
-        dict_clear(map);
         ans->header.cmd = CMD_ANS_WHOAMI;
         chunk_u32_add(&next_ans_chunk, CHUNK_ID_TYPE, DEVICE_TYPE_EXPANDER);
     } break;
     case CMD_REQ_DATA: {
         ans->header.cmd = CMD_ANS_DATA;
-        chunk_u16_add(&next_ans_chunk, CHUNK_ID_WETSENS, sens_get_state());
-        chunk_u16_add(&next_ans_chunk, CHUNK_ID_BAT_VOLT, bat_get_voltage());
-        chunk_u16_add(&next_ans_chunk, CHUNK_ID_RELAY1_STATUS,
-                      relay_is_open(RELAY1) ? 0x00FF : 0x0000);
-        chunk_u16_add(&next_ans_chunk, CHUNK_ID_RELAY2_STATUS,
-                      relay_is_open(RELAY2) ? 0x00FF : 0x0000);
-
+        ans_data_add(&next_ans_chunk);
     } break;
     case CMD_REQ_WRITE: {
         ans->header.cmd = CMD_ANS_WRITE;
         cmd_write_data(req, &next_ans_chunk);
     } break;
+    case CMD_REQ_READ: {
+        ans->header.cmd = CMD_ANS_READ;
+        cmd_read_data(req, &next_ans_chunk);
+    } break;
+    case CMD_REQ_GATHER: {
+        // Ответ - сводные посылки CMD_ANS_GATHER по окончании сбора
+        if (req->header.uid_dest == pack_ans.header.uid_src) {
+            gather_start(req);
+        }
+        return;
+    }
+    case CMD_REQ_BULK: {
+        // Ответы устройств идут мастеру обычным порядком, свой - в bulk_start.
+        // Широковещательный BULK разворачивал бы каждый расширитель
+        if (req->header.uid_dest == pack_ans.header.uid_src) {
+            bulk_start(req);
+        }
+        return;
+    }
     default: {
     } break;
     }
@@ -181,54 +2421,259 @@ static void cmd_work_master()
                            + ans->header.data_sz
                            + sizeof(pack_ans.crc);
     crc16_add2pack(ans, pack_ans_size);
-    send_fifo_push(&send_fifo, ans, pack_ans_size);
+    send_resp_push(0, ans, pack_ans_size);
 }
 
 static void cmd_work_slave(uint32_t num)
 {
-    if (aura_flags_pack_received[num] == 0) {
+    if (fifo_is_empty(slave_fifo(num))) {
         return;
     }
 
-    struct pack *p = &packs[num];
+    struct pack *p = (struct pack *)fifo_pop(slave_fifo(num));
+    // Широковещательный запрос снизу приходит только по петле. Ответы на
+    // запросы мастера с uid_src 0 тоже идут с uid_dest 0, но кэш не занимают
+    if ((p->header.uid_dest == 0) && aura_is_req(p) && dup_check(num, p)) {
+        return;
+    }
+    port_reply_match(num, p);
+    // Маршрут обновляется по любой верной посылке, не только по WHOAMI
+    route_learn(p->header.uid_src, num);
+    if (poll_store(p)) {
+        return;
+    }
+    if (p->header.uid_dest == pack_ans.header.uid_src) {
+        // Ответ на свой запрос после срока сбора мастеру не нужен
+        if (gather.is_running) {
+            gather_add(p->header.uid_src, p->data, p->header.data_sz);
+        } else {
+            aura_stat.late_drop++;
+        }
+        return;
+    }
 
     switch (p->header.cmd) {
     case CMD_ANS_WHOAMI: {
-        dict_add(map, p->header.uid_src, num);
+        topo_add(num, p);
+        route_learn_path(num, p);
         struct chunk_u32 *c = (struct chunk_u32 *)&p->data;
         c++;
-        if (p->header.data_sz == sizeof(struct chunk_u32)) {
+        uint16_t data_sz = p->header.data_sz;
+        // Свой uid дописывается, только если за типом идет один chunk
+        // CHUNK_ID_UIDS до конца посылки, иначе ответ уходит как есть
+        uint32_t is_path = (c->hdr.id == CHUNK_ID_UIDS)
+                           && (c->hdr.size % sizeof(uint32_t) == 0)
+                           && (sizeof(struct chunk_u32) + sizeof(struct chunk_hdr)
+                               + c->hdr.size == data_sz);
+        if ((data_sz < sizeof(struct chunk_u32))
+            || ((data_sz > sizeof(struct chunk_u32)) && !is_path)) {
+            send_resp_push(num, p, aura_pack_size(p));
+            break;
+        }
+        // CRC пересчитывается только по измененным полям и дописанному uid
+        uint32_t size = sizeof(struct header) + data_sz;
+        crc16_t crc = crc16_get(p, size);
+        if (data_sz + sizeof(struct chunk_u32) > AURA_MAX_DATA_SIZE) {
+            // Путь длиннее, чем помещается в посылку: уходит без своего uid
+        } else if (data_sz == sizeof(struct chunk_u32)) {
             p->header.data_sz += sizeof(struct chunk_u32);
             c->hdr.id = CHUNK_ID_UIDS;
             c->hdr.type = CHUNK_TYPE_ARR_U32,
-            c->hdr.size = sizeof(struct chunk_u32);
+            c->hdr.size = sizeof(c->val);
             c->val = pack_ans.header.uid_src;
         } else {
             p->header.data_sz += sizeof(uint32_t);
             struct chunk_u32arr *c_arr = (struct chunk_u32arr *)c;
+            uint16_t chunk_sz = c->hdr.size;
             uint32_t uids_count = c->hdr.size / sizeof(uint32_t);
             c->hdr.size += sizeof(uint32_t);
             c_arr->arr[uids_count] = pack_ans.header.uid_src;
+            uint16_t chunk_sz_new = c->hdr.size;
+            crc = crc16_patch(crc, size, (uint32_t)&c->hdr.size - (uint32_t)p,
+                              &chunk_sz, &chunk_sz_new, sizeof(chunk_sz));
         }
-        uint32_t pack_size = sizeof(struct header)
-                           + p->header.data_sz
-                           + sizeof(crc16_t);
-        crc16_add2pack(p, pack_size);
-        send_fifo_push(&send_fifo, p, pack_size);
+        uint16_t data_sz_new = p->header.data_sz;
+        crc = crc16_patch(crc, size, offsetof(struct header, data_sz),
+                          &data_sz, &data_sz_new, sizeof(data_sz));
+        crc = crc16_calc_continue(crc, &p->data[data_sz], data_sz_new - data_sz);
+        crc16_set(p, sizeof(struct header) + data_sz_new, crc);
+        send_resp_push(num, p, aura_pack_size(p));
     } break;
     default: {
         uint32_t pack_size = sizeof(struct header)
                            + p->header.data_sz
                            + sizeof(crc16_t);
-        send_fifo_push(&send_fifo, p, pack_size);
+        send_resp_push(num, p, pack_size);
     } break;
     }
-    aura_flags_pack_received[num] = 0;
+}
+
+static void send_resp_busy(void)
+{
+    // Снимок вместе со сбросом: uid и счетчик не разойдутся
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t uid_master = busy.uid_master;
+    uint32_t vals[] = {busy.uid, busy.count};
+    busy.count = 0;
+    busy.is_pending = 0;
+    __set_PRIMASK(primask);
+
+    struct pack *p = &pack_tx;
+    p->header.cnt = cnt_send_pack++;
+    p->header.uid_src = pack_ans.header.uid_src;
+    p->header.uid_dest = uid_master;
+    p->header.cmd = CMD_ANS_BUSY;
+    void *next_chunk = p->data;
+    chunk_u32arr_add(&next_chunk, CHUNK_ID_BUSY, vals, arr_len(vals));
+    p->header.data_sz = (uint32_t)next_chunk - (uint32_t)p->data;
+    uint32_t pack_size = aura_pack_size(p);
+    crc16_add2pack(p, pack_size);
+    aura_stat.busy_sent++;
+    pack_size = aura_v2_encode(0, p, pack_size);
+    uart_send_array(&uarts[0], p, aura_crc_seal(0, p, pack_size));
+}
+
+// Очередь, чья посылка уходит следующей, без ее извлечения; -1U - пусто
+static uint32_t sched_pick(void)
+{
+    // Квант не меньше максимальной посылки, поэтому за один круг
+    // посылка найдется в любой непустой очереди
+    for (uint32_t n = 0; n <= UART_COUNT; n++) {
+        uint32_t i = sched.cur;
+        struct send_fifo *f = &send_fifos[i];
+        if (send_fifo_is_not_empty(f)) {
+            if (!sched.is_visited) {
+                sched.is_visited = 1;
+                sched.deficit[i] += sched.weights[i] * AURA_SCHED_QUANTUM;
+            }
+            struct pack *p = (struct pack *)send_fifo_get_ptail(f);
+            if (aura_pack_size(p) <= sched.deficit[i]) {
+                return i;
+            }
+        } else {
+            sched.deficit[i] = 0;
+        }
+        sched.cur = (i + 1) % UART_COUNT;
+        sched.is_visited = 0;
+    }
+    return -1U;
+}
+
+// Забирает голову очереди i в dst, возвращает размер посылки
+static uint32_t sched_pop(uint32_t i, void *dst)
+{
+    struct send_fifo *f = &send_fifos[i];
+    struct pack *p = (struct pack *)send_fifo_get_ptail(f);
+    uint32_t pack_size = aura_pack_size(p);
+    sched.deficit[i] -= pack_size;
+    uint32_t ms = uart_get_ms();
+    uint32_t hol_ms = ms - sched.hol_ms[i];
+    if (hol_ms > sched.hol_ms_max[i]) {
+        sched.hol_ms_max[i] = hol_ms;
+    }
+    sched.hol_ms[i] = ms;
+    if (aura_flag_switch_ack
+        && (p->header.uid_src == pack_ans.header.uid_src)
+        && (p->header.cnt == switch_ack_cnt)) {
+        aura_flag_switch_ack = 0;
+        aura_flag_switch_tx = 1;
+    }
+    aura_stat.up_payload += p->header.data_sz;
+    memcpy_u8(p, dst, pack_size);
+    send_fifo_inc_tail(f, pack_size);
+    return pack_size;
+}
+
+static void send_resp_tx(void *p, uint32_t size)
+{
+    size = aura_v2_encode(0, p, size);
+    size = aura_crc_seal(0, p, size);
+    aura_stat.up_frames++;
+    aura_stat.up_bytes += size;
+    uart_send_array(&uarts[0], p, size);
+}
+
+#ifdef AURA_CONTAINER
+static void *container_add(void *next_chunk, const void *frame, uint32_t size)
+{
+    struct chunk *c = (struct chunk *)next_chunk;
+    c->hdr.id = CHUNK_ID_FRAME;
+    c->hdr.type = CHUNK_TYPE_ARR_U8;
+    c->hdr.size = size;
+    if (frame) {
+        memcpy_u8((void *)frame, c->data, size);
+    }
+    return (void *)((uint32_t)next_chunk + sizeof(c->hdr) + size);
+}
+
+// Вложенная посылка на линии v2 тоже уходит с коротким заголовком
+static void *container_encode(struct chunk *frame)
+{
+    frame->hdr.size = aura_v2_encode(0, frame->data, frame->hdr.size);
+    return (void *)((uint32_t)frame + sizeof(frame->hdr) + frame->hdr.size);
+}
+
+static uint32_t container_is_fit(void *next_chunk, uint32_t size)
+{
+    return (uint32_t)next_chunk + sizeof(struct chunk_hdr) + size
+        <= (uint32_t)&pack_container.data[container_mtu];
+}
+#endif
+
+static void send_resp_next()
+{
+    // Мастер должен узнать о потере раньше, чем истечет его таймаут
+    if (busy.is_pending) {
+        send_resp_busy();
+        return;
+    }
+    uint32_t i = sched_pick();
+    if (i == -1U) {
+        return;
+    }
+    uint32_t pack_size = sched_pop(i, &pack_tx);
+#ifdef AURA_CONTAINER
+    if (container_mtu == 0) {
+        send_resp_tx(&pack_tx, pack_size);
+        return;
+    }
+    // Контейнер собирается, только если за первой посылкой есть еще одна
+    struct pack_container *c = &pack_container;
+    container_add(c->data, &pack_tx, pack_size);
+    void *next_chunk = container_encode((struct chunk *)c->data);
+    uint32_t count = 1;
+    while ((i = sched_pick()) != -1U) {
+        struct pack *p = (struct pack *)send_fifo_get_ptail(&send_fifos[i]);
+        uint32_t size = aura_pack_size(p);
+        if (!container_is_fit(next_chunk, size)) {
+            break;
+        }
+        struct chunk *frame = (struct chunk *)next_chunk;
+        container_add(next_chunk, 0, size);
+        sched_pop(i, frame->data);
+        next_chunk = container_encode(frame);
+        count++;
+    }
+    if (count > 1) {
+        c->header.cnt = cnt_send_pack++;
+        c->header.uid_src = pack_ans.header.uid_src;
+        c->header.uid_dest = pack_tx.header.uid_dest;
+        c->header.cmd = CMD_ANS_CONTAINER;
+        c->header.data_sz = (uint32_t)next_chunk - (uint32_t)c->data;
+        uint32_t container_size = sizeof(c->header) + c->header.data_sz + sizeof(crc16_t);
+        crc16_add2pack(c, container_size);
+        aura_stat.up_containers++;
+        send_resp_tx(c, container_size);
+        return;
+    }
+#endif
+    send_resp_tx(&pack_tx, pack_size);
 }
 
 static void send_resp_data()
 {
-    if (send_fifo_is_empty(&send_fifo)) {
+    if (send_resp_is_empty()) {
         return;
     }
     if (uarts[0].tx.count != 0) {
@@ -237,15 +2682,12 @@ static void send_resp_data()
     if (aura_flag_send_delay){
         return;
     }
-    // taking data from fifo
-    struct pack *p = (struct pack *)send_fifo_get_ptail(&send_fifo);
-
-    uint32_t pack_size = sizeof(struct header)
-                       + p->header.data_sz
-                       + sizeof(crc16_t);
-    
-    send_fifo_inc_tail(&send_fifo, pack_size);
-    uart_send_array(&uarts[0], p, pack_size);
+#ifdef AURA_CONTAINER
+    if (!send_resp_is_ready()) {
+        return;
+    }
+#endif
+    send_resp_next();
 }
 
 void tim7_update_callback()
@@ -258,7 +2700,16 @@ void aura_process(void)
     cmd_work_master();
     for (uint32_t i = 1; i < UART_COUNT; i++) {
         cmd_work_slave(i);
+        port_work_timeouts(i);
     }
+    route_work_aging();
+#ifdef AURA_V2
+    link_addr_work();
+#endif
+    route_discovery_work();
+    topo_replay_work();
+    gather_work();
+    poll_work();
     send_resp_data();
 }
 
@@ -266,48 +2717,138 @@ void aura_init(void)
 {
     uint32_t uid = uid_hash();
     pack_ans.header.uid_src = uid;
+#ifdef AURA_CRC32
+    crc32_init();
+#endif
+#ifdef AURA_AUTOBAUD
+    autobaud_start();
+#else
     aura_recv_package(0);
+#endif
 }
 
 void uart_recv_complete_callback(struct uart *u)
 {
     uint32_t num = u->num;
     enum state_recv *s = &states_recv[num];
-    struct pack *p = &packs[num];
+    struct pack *p = aura_rx_pack(num);
 
     switch (*s) {
     case STATE_RECV_START: {
-        *s = STATE_RECV_HEADER;
-
-        if (p->header.data_sz > sizeof(p->data)) {
-            p->header.data_sz = 0;
-        }
-
-        uart_recv_array(u,
-                        p->data,
-                        p->header.data_sz + sizeof(crc16_t));
+        aura_recv_continue(num, (uint32_t)u->rx.data - (uint32_t)p);
     } break;
     case STATE_RECV_HEADER: {
-        uint32_t pack_size = sizeof(struct header)
-                           + p->header.data_sz
-                           + sizeof(crc16_t);
-        if (crc16_is_valid(p, pack_size)) {
-            aura_flags_pack_received[num] = 1;
+        uint32_t size = rx_body[num] + aura_crc_size(num);
+        if (aura_recv_done(num, p)) {
+            break;
+        }
+        if (aura_rx_pack(num) != p) {
+            // Посылка шла напрямую в порт назначения, ее буфер уже не наш
+            aura_recv_package(num);
+        } else {
+            aura_recv_continue(num, aura_recv_resync(num, size));
         }
-        aura_recv_package(num);
     } break;
     }
 }
 
+void uart_recv_data_callback(struct uart *u, uint32_t count)
+{
+    uint32_t num = u->num;
+    uint8_t *data = u->rx.data - count;
+    if (aura_is_crc32(num) && (states_recv[num] == STATE_RECV_HEADER)) {
+        // crc16 нужна только данным, без crc32 в конце
+        uint8_t *end = (uint8_t *)aura_rx_pack(num) + rx_body[num];
+        count = (data >= end) ? 0
+              : (u->rx.data > end) ? (uint32_t)(end - data)
+                                   : count;
+    }
+    crcs_rx[num] = crc16_calc_continue(crcs_rx[num], data, count);
+#ifdef AURA_CUT_THROUGH
+    if ((num == 0) && cut_through.dst) {
+        aura_cut_through_data(u);
+    }
+#endif
+}
+
 void uart_send_complete_callback(struct uart *u)
 {
-    aura_recv_package(u->num);
+    if ((u->num == 0) && aura_flag_switch_tx) {
+        aura_flag_switch_tx = 0;
+        if (aura_flag_uart0_cfg) {
+            aura_flag_uart0_cfg = 0;
+            uart_set_cfg(u, &uart0_cfg_pending);
+        }
+#ifdef AURA_V2
+        if (aura_flag_v2_link) {
+            aura_flag_v2_link = 0;
+            v2_link = v2_link_pending;
+        }
+#endif
+#ifdef AURA_CRC32
+        if (aura_flag_crc32_ports) {
+            aura_flag_crc32_ports = 0;
+            crc32_ports = (crc32_ports & ~1U) | (crc32_ports_pending & 1U);
+        }
+#endif
+    }
+    // Прием от мастера не зависит от передачи и не перезапускается
+    if (u->num != 0) {
+        aura_recv_package(u->num);
+        port_send_complete(u->num);
+    }
+}
+
+void uart_send_dma_complete_callback(struct uart *u)
+{
+#ifdef AURA_TX_BURST
+    // Следующая посылка стартует, пока USART еще выдвигает хвост текущей.
+    // После ответа, переключающего линию, ждем TC
+    if ((u->num == 0)
+        && !aura_flag_switch_tx
+        && !send_resp_is_empty()
+#ifdef AURA_CONTAINER
+        && send_resp_is_ready()
+#endif
+        && !aura_flag_send_delay) {
+        send_resp_next();
+    }
+#else
+    (void)u;
+#endif
 }
 
 void uart_recv_timeout_callback(struct uart *u)
 {
+    struct pack *p = aura_rx_pack(u->num);
+    uint32_t have = (uint32_t)u->rx.data - (uint32_t)p;
     uart_stop_recv(u);
-    if (u->num == 0) {
+    aura_recv_error(u->num);
+    if (u->num != 0) {
+        return;
+    }
+    // Пауза после заголовка не видна: таймаут взводится только первым
+    // байтом. Следующая посылка могла уже лечь в тело оборванной,
+    // ее начало ищется в принятом
+    if ((aura_rx_pack(0) == p) && (have > 1) && (have <= sizeof(struct pack))) {
+        aura_recv_continue(0, aura_recv_resync(0, have));
+    } else {
         aura_recv_package(0);
     }
 }
+
+void autobaud_complete_callback(uint32_t baudrate)
+{
+    struct uart *u = &uarts[0];
+    struct uart_cfg cfg = u->cfg;
+    cfg.baudrate = baudrate;
+    if (u->tx.count != 0) {
+        // Скорость меняется после текущей передачи
+        uart0_cfg_pending = cfg;
+        aura_flag_uart0_cfg = 1;
+        aura_flag_switch_tx = 1;
+    } else {
+        uart_set_cfg(u, &cfg);
+    }
+    aura_recv_package(0);
+}
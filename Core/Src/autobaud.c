@@ -0,0 +1,103 @@
+#include "autobaud.h"
+#include "usart_ex.h"
+#include "tools.h"
+#include "stm32f4xx_ll_tim.h"
+#include "stm32f4xx_ll_gpio.h"
+
+// TIM1 тактируется 100 МГц, предделитель 20
+#define AUTOBAUD_TIM_CLK      5000000U
+// Допуск привязки к стандартной скорости, %
+#define AUTOBAUD_SNAP_PERCENT 4
+
+#define AUTOBAUD_RX_PORT      GPIOA
+#define AUTOBAUD_RX_PIN       LL_GPIO_PIN_10
+#define AUTOBAUD_RX_AF_TIM    LL_GPIO_AF_1
+#define AUTOBAUD_RX_AF_USART  LL_GPIO_AF_7
+
+static const uint32_t std_baudrates[] = {
+    1200, 2400, 4800, 9600, 19200, 38400, 57600,
+    115200, 230400, 460800, 921600, 1000000,
+};
+
+static uint16_t edges[3];
+static uint32_t edges_count = 0;
+static uint32_t is_running = 0;
+
+void autobaud_start(void)
+{
+    edges_count = 0;
+    is_running = 1;
+    // На время измерения RX USART1 переключается на TIM1_CH3
+    LL_GPIO_SetAFPin_8_15(AUTOBAUD_RX_PORT, AUTOBAUD_RX_PIN, AUTOBAUD_RX_AF_TIM);
+    LL_TIM_ClearFlag_CC3(TIM1);
+    LL_TIM_ClearFlag_CC3OVR(TIM1);
+    LL_TIM_EnableIT_CC3(TIM1);
+}
+
+uint32_t autobaud_is_running(void)
+{
+    return is_running;
+}
+
+static void autobaud_stop(void)
+{
+    LL_TIM_DisableIT_CC3(TIM1);
+    LL_GPIO_SetAFPin_8_15(AUTOBAUD_RX_PORT, AUTOBAUD_RX_PIN, AUTOBAUD_RX_AF_USART);
+    is_running = 0;
+}
+
+static uint32_t autobaud_snap(uint32_t baudrate)
+{
+    for (uint32_t i = 0; i < arr_len(std_baudrates); i++) {
+        uint32_t std = std_baudrates[i];
+        uint32_t diff = (baudrate > std) ? baudrate - std : std - baudrate;
+        if (diff * 100 <= std * AUTOBAUD_SNAP_PERCENT) {
+            return std;
+        }
+    }
+    return baudrate;
+}
+
+// Спадающие фронты первого байта 'A' (0x41, младшим битом вперед):
+// старт-бит в 0, бит 1 в 2T, бит 7 в 8T. Второй интервал втрое длиннее первого
+static uint32_t autobaud_calc(void)
+{
+    uint32_t d1 = (uint16_t)(edges[1] - edges[0]);
+    uint32_t d2 = (uint16_t)(edges[2] - edges[1]);
+    if ((d1 == 0)
+        || (d2 * 8 < d1 * 3 * 7)
+        || (d2 * 8 > d1 * 3 * 9)) {
+        return 0;
+    }
+    uint32_t baudrate = autobaud_snap(AUTOBAUD_TIM_CLK * 8 / (d1 + d2));
+    if ((baudrate < UART_BAUDRATE_MIN) || (baudrate > UART_BAUDRATE_MAX)) {
+        return 0;
+    }
+    return baudrate;
+}
+
+void tim1_cc3_callback(uint16_t capture)
+{
+    if (!is_running) {
+        return;
+    }
+    edges[edges_count++] = capture;
+    if (edges_count < arr_len(edges)) {
+        return;
+    }
+    uint32_t baudrate = autobaud_calc();
+    if (baudrate == 0) {
+        // Окно сдвигается на один фронт, пока не совпадет шаблон 'A'
+        edges[0] = edges[1];
+        edges[1] = edges[2];
+        edges_count = 2;
+        return;
+    }
+    autobaud_stop();
+    autobaud_complete_callback(baudrate);
+}
+
+__WEAK void autobaud_complete_callback(uint32_t baudrate)
+{
+    (void)baudrate;
+}
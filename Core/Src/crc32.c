@@ -0,0 +1,56 @@
+#include "crc32.h"
+#include "crc16.h"
+#include "stm32f4xx_ll_bus.h"
+#include "stm32f4xx_ll_crc.h"
+
+void crc32_init(void)
+{
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_CRC);
+}
+
+// Аппаратный блок CRC: полином CRC-32 0x04C11DB7, начальное 0xFFFFFFFF,
+// 32-битные слова без отражения. Данные подаются словами little-endian,
+// неполное последнее слово дополняется нулями
+crc32_t crc32_calc(const void *buf, uint32_t size)
+{
+    const uint8_t *p = buf;
+
+    // Блок один на main и все прерывания
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    LL_CRC_ResetCRCCalculationUnit(CRC);
+    while (size >= sizeof(uint32_t)) {
+        LL_CRC_FeedData32(CRC, __UNALIGNED_UINT32_READ(p));
+        p += sizeof(uint32_t);
+        size -= sizeof(uint32_t);
+    }
+    if (size != 0) {
+        uint32_t word = 0;
+        for (uint32_t i = 0; i < size; i++) {
+            word |= (uint32_t)p[i] << (8 * i);
+        }
+        LL_CRC_FeedData32(CRC, word);
+    }
+    crc32_t crc = LL_CRC_ReadData32(CRC);
+    __set_PRIMASK(primask);
+
+    return crc;
+}
+
+#ifdef CRC32_BENCH
+// Такты DWT на посылку size байт: crc32_calc блоком CRC и crc16_calc
+// таблицами, для выбора контрольной суммы на линии
+void crc32_bench(const void *buf, uint32_t size, uint32_t *cycles32, uint32_t *cycles16)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    uint32_t start = DWT->CYCCNT;
+    volatile crc32_t crc32 = crc32_calc(buf, size);
+    *cycles32 = DWT->CYCCNT - start;
+    start = DWT->CYCCNT;
+    volatile crc16_t crc16 = crc16_calc(buf, size);
+    *cycles16 = DWT->CYCCNT - start;
+    (void)crc32;
+    (void)crc16;
+}
+#endif
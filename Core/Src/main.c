@@ -2,6 +2,7 @@
 #include "adc.h"
 #include "i2c.h"
 #include "usart.h"
+#include "usart_ex.h"
 #include "tim.h"
 #include "gpio.h"
 #include "gpio_ex.h"
@@ -42,10 +43,14 @@ int main(void)
     MX_USART2_UART_Init();
     MX_USART3_UART_Init();
     MX_USART6_UART_Init();
+    uart_dma_init();
     MX_TIM6_Init();
     #ifdef DELAY
         MX_TIM7_Init();
     #endif
+    #ifdef AURA_AUTOBAUD
+        MX_TIM1_Init();
+    #endif
     ADC_Configure_DMA();
     MX_ADC1_Init();
     MX_I2C1_Init();
@@ -6,6 +6,7 @@
 #include "gpio.h"
 #include "gpio_ex.h"
 #include "aura.h"
+#include "autobaud.h"
 
 /* External variables --------------------------------------------------------*/
 
@@ -114,6 +115,36 @@ declare_usart_irq_handler(UART7)
 declare_usart_irq_handler(UART8)
 declare_usart_irq_handler(UART9)
     // clang-format on
+
+#define declare_uart_dma_rx_irq_handler(_dma, _stream, _name) \
+    void _dma##_Stream##_stream##_IRQHandler(void)          \
+    {                                                       \
+        uart_dma_rx_irq_callback(&uarts[UART_NUM_##_name]); \
+    }
+
+// clang-format off
+declare_uart_dma_rx_irq_handler(DMA2, 2, USART1)
+declare_uart_dma_rx_irq_handler(DMA1, 5, USART2)
+declare_uart_dma_rx_irq_handler(DMA1, 1, USART3)
+declare_uart_dma_rx_irq_handler(DMA1, 2, UART4)
+declare_uart_dma_rx_irq_handler(DMA1, 0, UART5)
+declare_uart_dma_rx_irq_handler(DMA2, 1, USART6)
+declare_uart_dma_rx_irq_handler(DMA1, 3, UART7)
+declare_uart_dma_rx_irq_handler(DMA1, 6, UART8)
+    // clang-format on
+
+#define declare_uart_dma_tx_irq_handler(_dma, _stream, _name) \
+    void _dma##_Stream##_stream##_IRQHandler(void)          \
+    {                                                       \
+        uart_dma_tx_irq_callback(&uarts[UART_NUM_##_name]); \
+    }
+
+// clang-format off
+declare_uart_dma_tx_irq_handler(DMA2, 7, USART1)
+declare_uart_dma_tx_irq_handler(DMA1, 4, UART4)
+declare_uart_dma_tx_irq_handler(DMA1, 7, UART5)
+declare_uart_dma_tx_irq_handler(DMA2, 6, USART6)
+    // clang-format on
     
 void ADC_IRQHandler(void)
 {
@@ -162,3 +193,12 @@ void TIM7_IRQHandler(void)
     tim7_update_callback();
   } 
 }
+
+void TIM1_CC_IRQHandler(void)
+{
+  if (LL_TIM_IsActiveFlag_CC3(TIM1))
+  {
+    LL_TIM_ClearFlag_CC3(TIM1);
+    tim1_cc3_callback(LL_TIM_IC_GetCaptureCH3(TIM1));
+  }
+}
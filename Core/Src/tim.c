@@ -43,3 +43,26 @@ void MX_TIM7_Init(void)
     LL_TIM_EnableCounter(TIM7);
     LL_TIM_EnableIT_UPDATE(TIM7);
 }
+
+// Захват спадающих фронтов RX USART1 (TIM1_CH3) для автоопределения скорости,
+// счетчик 5 МГц
+void MX_TIM1_Init(void)
+{
+    LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM1);
+
+    NVIC_SetPriority(TIM1_CC_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
+    NVIC_EnableIRQ(TIM1_CC_IRQn);
+
+    LL_TIM_InitTypeDef TIM_InitStruct = {
+        .Prescaler = 20 - 1,
+        .CounterMode = LL_TIM_COUNTERMODE_UP,
+        .Autoreload = 0xFFFF,
+    };
+    LL_TIM_Init(TIM1, &TIM_InitStruct);
+    LL_TIM_IC_SetActiveInput(TIM1, LL_TIM_CHANNEL_CH3, LL_TIM_ACTIVEINPUT_DIRECTTI);
+    LL_TIM_IC_SetPrescaler(TIM1, LL_TIM_CHANNEL_CH3, LL_TIM_ICPSC_DIV1);
+    LL_TIM_IC_SetFilter(TIM1, LL_TIM_CHANNEL_CH3, LL_TIM_IC_FILTER_FDIV1);
+    LL_TIM_IC_SetPolarity(TIM1, LL_TIM_CHANNEL_CH3, LL_TIM_IC_POLARITY_FALLING);
+    LL_TIM_CC_EnableChannel(TIM1, LL_TIM_CHANNEL_CH3);
+    LL_TIM_EnableCounter(TIM1);
+}
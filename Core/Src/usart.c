@@ -1,14 +1,11 @@
 
 
 #include "usart.h"
-
-#define BAUDRATE 19200
+#include "usart_ex.h"
 
 /* UART4 init function */
 void MX_UART4_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -31,23 +28,12 @@ void MX_UART4_Init(void)
     NVIC_SetPriority(UART4_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(UART4_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(UART4, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(UART4);
-    LL_USART_Enable(UART4);
+    uart_apply_cfg(&uarts[UART_NUM_UART4]);
 }
 
 /* UART5 init function */
 void MX_UART5_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -70,23 +56,12 @@ void MX_UART5_Init(void)
     NVIC_SetPriority(UART5_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(UART5_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(UART5, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(UART5);
-    LL_USART_Enable(UART5);
+    uart_apply_cfg(&uarts[UART_NUM_UART5]);
 }
 
 /* UART7 init function */
 void MX_UART7_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -109,23 +84,12 @@ void MX_UART7_Init(void)
     NVIC_SetPriority(UART7_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(UART7_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(UART7, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(UART7);
-    LL_USART_Enable(UART7);
+    uart_apply_cfg(&uarts[UART_NUM_UART7]);
 }
 
 /* UART8 init function */
 void MX_UART8_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -148,23 +112,12 @@ void MX_UART8_Init(void)
     NVIC_SetPriority(UART8_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(UART8_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(UART8, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(UART8);
-    LL_USART_Enable(UART8);
+    uart_apply_cfg(&uarts[UART_NUM_UART8]);
 }
 
 /* UART9 init function */
 void MX_UART9_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -187,24 +140,13 @@ void MX_UART9_Init(void)
     NVIC_SetPriority(UART9_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(UART9_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(UART9, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(UART9);
-    LL_USART_Enable(UART9);
+    uart_apply_cfg(&uarts[UART_NUM_UART9]);
 }
 
 /* USART1 init function */
 
 void MX_USART1_UART_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -227,24 +169,13 @@ void MX_USART1_UART_Init(void)
     NVIC_SetPriority(USART1_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(USART1_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(USART1, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(USART1);    
-    LL_USART_Enable(USART1);
+    uart_apply_cfg(&uarts[UART_NUM_USART1]);
 }
 
 /* USART2 init function */
 
 void MX_USART2_UART_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -267,24 +198,13 @@ void MX_USART2_UART_Init(void)
     NVIC_SetPriority(USART2_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(USART2_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(USART2, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(USART2);
-    LL_USART_Enable(USART2);
+    uart_apply_cfg(&uarts[UART_NUM_USART2]);
 }
 
 /* USART3 init function */
 
 void MX_USART3_UART_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -316,24 +236,13 @@ void MX_USART3_UART_Init(void)
     NVIC_SetPriority(USART3_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(USART3_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(USART3, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(USART3);
-    LL_USART_Enable(USART3);
+    uart_apply_cfg(&uarts[UART_NUM_USART3]);
 }
 
 /* USART6 init function */
 
 void MX_USART6_UART_Init(void)
 {
-    LL_USART_InitTypeDef USART_InitStruct = {0};
-
     LL_GPIO_InitTypeDef GPIO_InitStruct = {0};
 
     /* Peripheral clock enable */
@@ -356,14 +265,5 @@ void MX_USART6_UART_Init(void)
     NVIC_SetPriority(USART6_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
     NVIC_EnableIRQ(USART6_IRQn);
 
-    USART_InitStruct.BaudRate = BAUDRATE;
-    USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
-    USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
-    USART_InitStruct.Parity = LL_USART_PARITY_NONE;
-    USART_InitStruct.TransferDirection = LL_USART_DIRECTION_TX_RX;
-    USART_InitStruct.HardwareFlowControl = LL_USART_HWCONTROL_NONE;
-    USART_InitStruct.OverSampling = LL_USART_OVERSAMPLING_16;
-    LL_USART_Init(USART6, &USART_InitStruct);
-    LL_USART_ConfigAsyncMode(USART6);
-    LL_USART_Enable(USART6);
+    uart_apply_cfg(&uarts[UART_NUM_USART6]);
 }
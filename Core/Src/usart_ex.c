@@ -1,64 +1,392 @@
 #include "usart_ex.h"
 #include "gpio_ex.h"
+#include "tools.h"
 #include "stm32f4xx_ll_usart.h"
 #include "stm32f4xx_ll_gpio.h"
+#include "stm32f4xx_ll_dma.h"
+#include "stm32f4xx_ll_bus.h"
 
-#define declare_usart(_name)                                         \
+#define declare_usart(_name, _baudrate)                              \
     [UART_NUM_##_name] = {                                           \
         .name = _name,                                               \
+        .irqn = _name##_IRQn,                                        \
         .num = UART_NUM_##_name,                                     \
+        .cfg = {.baudrate = (_baudrate), .stop_bits = 1},            \
         .de = {.port = USART_RDE_GPIO_Port, .pin = _name##_RDE_Pin}, \
     }
 
 struct uart uarts[UART_COUNT] = {
-    declare_usart(USART1),
-    declare_usart(USART2),
-    declare_usart(USART3),
-    declare_usart(UART4),
-    declare_usart(UART5),
-    declare_usart(USART6),
-    declare_usart(UART7),
-    declare_usart(UART8),
-    declare_usart(UART9),
+    declare_usart(USART1, UART_BAUDRATE_DEFAULT),
+    declare_usart(USART2, UART_BAUDRATE_DEFAULT),
+    declare_usart(USART3, UART_BAUDRATE_DEFAULT),
+    declare_usart(UART4, UART_BAUDRATE_DEFAULT),
+    declare_usart(UART5, UART_BAUDRATE_DEFAULT),
+    declare_usart(USART6, UART_BAUDRATE_DEFAULT),
+    declare_usart(UART7, UART_BAUDRATE_DEFAULT),
+    declare_usart(UART8, UART_BAUDRATE_DEFAULT),
+    declare_usart(UART9, UART_BAUDRATE_DEFAULT),
 };
 
+// Миллисекунды от запуска, считаются в прерывании TIM6
+static volatile uint32_t uart_ms = 0;
+
+static const uint32_t uart_ll_parity[] = {
+    [UART_PARITY_NONE] = LL_USART_PARITY_NONE,
+    [UART_PARITY_EVEN] = LL_USART_PARITY_EVEN,
+    [UART_PARITY_ODD] = LL_USART_PARITY_ODD,
+};
+
+#ifdef UART_USE_DMA_RX
+// Потоки DMA приема по таблицам запросов RM0430.
+// UART9_RX делит поток DMA2 с USART1_TX, поэтому остается на RXNE
+// clang-format off
+static const struct uart_dma uart_dma_rx[UART_COUNT] = {
+    [UART_NUM_USART1] = {DMA2, LL_DMA_STREAM_2, LL_DMA_CHANNEL_4, DMA2_Stream2_IRQn},
+    [UART_NUM_USART2] = {DMA1, LL_DMA_STREAM_5, LL_DMA_CHANNEL_4, DMA1_Stream5_IRQn},
+    [UART_NUM_USART3] = {DMA1, LL_DMA_STREAM_1, LL_DMA_CHANNEL_4, DMA1_Stream1_IRQn},
+    [UART_NUM_UART4]  = {DMA1, LL_DMA_STREAM_2, LL_DMA_CHANNEL_4, DMA1_Stream2_IRQn},
+    [UART_NUM_UART5]  = {DMA1, LL_DMA_STREAM_0, LL_DMA_CHANNEL_4, DMA1_Stream0_IRQn},
+    [UART_NUM_USART6] = {DMA2, LL_DMA_STREAM_1, LL_DMA_CHANNEL_5, DMA2_Stream1_IRQn},
+    [UART_NUM_UART7]  = {DMA1, LL_DMA_STREAM_3, LL_DMA_CHANNEL_5, DMA1_Stream3_IRQn},
+    [UART_NUM_UART8]  = {DMA1, LL_DMA_STREAM_6, LL_DMA_CHANNEL_5, DMA1_Stream6_IRQn},
+};
+// clang-format on
+
+static uint8_t rx_rings[UART_COUNT][UART_RX_RING_SIZE] __ALIGNED(4);
+#endif
+
+#ifdef UART_USE_DMA_TX
+// Запросы TX остальных портов попадают на потоки, занятые приемом,
+// они передают по TXE
+// clang-format off
+static const struct uart_dma uart_dma_tx[UART_COUNT] = {
+    [UART_NUM_USART1] = {DMA2, LL_DMA_STREAM_7, LL_DMA_CHANNEL_4, DMA2_Stream7_IRQn},
+    [UART_NUM_UART4]  = {DMA1, LL_DMA_STREAM_4, LL_DMA_CHANNEL_4, DMA1_Stream4_IRQn},
+    [UART_NUM_UART5]  = {DMA1, LL_DMA_STREAM_7, LL_DMA_CHANNEL_4, DMA1_Stream7_IRQn},
+    [UART_NUM_USART6] = {DMA2, LL_DMA_STREAM_6, LL_DMA_CHANNEL_5, DMA2_Stream6_IRQn},
+};
+// clang-format on
+#endif
+
+#ifdef UART_STATS
+#define uart_stat_begin() uint32_t stat_start = DWT->CYCCNT
+#define uart_stat_end(_u)                                      \
+    do {                                                       \
+        (_u)->stat.irq_count++;                                \
+        (_u)->stat.irq_cycles += DWT->CYCCNT - stat_start;     \
+    } while (0)
+#else
+#define uart_stat_begin()
+#define uart_stat_end(_u)
+#endif
+
+static void dma_clear_flags(const struct uart_dma *d)
+{
+    // Флаги потоков 0..3 лежат в LIFCR, 4..7 в HIFCR со смещениями 0, 6, 16, 22
+    static const uint8_t shift[4] = {0, 6, 16, 22};
+    uint32_t mask = (DMA_LIFCR_CFEIF0
+                     | DMA_LIFCR_CDMEIF0
+                     | DMA_LIFCR_CTEIF0
+                     | DMA_LIFCR_CHTIF0
+                     | DMA_LIFCR_CTCIF0)
+                  << shift[d->stream & 0x03];
+    if (d->stream < LL_DMA_STREAM_4) {
+        d->dma->LIFCR = mask;
+    } else {
+        d->dma->HIFCR = mask;
+    }
+}
+
+inline static uint32_t uart_ring_head(struct uart *u)
+{
+    const struct uart_dma *d = u->ring.dma;
+    uint32_t head = UART_RX_RING_SIZE - LL_DMA_GetDataLength(d->dma, d->stream);
+    return head & (UART_RX_RING_SIZE - 1);
+}
+
+static void uart_ring_drain(struct uart *u)
+{
+    uint32_t head = uart_ring_head(u);
+
+    while (u->ring.tail != head) {
+        if (u->rx.count == 0) {
+            // Прием не запущен: байты теряются так же, как при выключенном RXNE
+            u->ring.tail = head;
+            break;
+        }
+        uint32_t count = (head - u->ring.tail) & (UART_RX_RING_SIZE - 1);
+        if (count > u->rx.count) {
+            count = u->rx.count;
+        }
+        u->timeout.is_enable = 1;
+        for (uint32_t i = 0; i < count; i++) {
+            *u->rx.data++ = u->ring.buf[u->ring.tail];
+            u->ring.tail = (u->ring.tail + 1) & (UART_RX_RING_SIZE - 1);
+        }
+        u->rx.count -= count;
+        uart_recv_data_callback(u, count);
+        if (u->rx.count == 0) {
+            // Остаток кольца не сбрасываем, его заберет следующий uart_recv_array
+            u->timeout.is_enable = 0;
+            uart_recv_complete_callback(u);
+        }
+    }
+}
+
+void uart_dma_init(void)
+{
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA2);
+
+#ifdef UART_STATS
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+#ifdef UART_USE_DMA_RX
+    for (uint32_t i = 0; i < UART_COUNT; i++) {
+        const struct uart_dma *d = &uart_dma_rx[i];
+        if (d->dma == 0) {
+            continue;
+        }
+        struct uart *u = &uarts[i];
+        u->ring.dma = d;
+        u->ring.buf = rx_rings[i];
+        u->ring.tail = 0;
+
+        NVIC_SetPriority(d->irqn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
+        NVIC_EnableIRQ(d->irqn);
+
+        LL_DMA_SetChannelSelection(d->dma, d->stream, d->channel);
+        LL_DMA_ConfigTransfer(d->dma, d->stream,
+                              LL_DMA_DIRECTION_PERIPH_TO_MEMORY
+                                  | LL_DMA_MODE_CIRCULAR
+                                  | LL_DMA_PERIPH_NOINCREMENT
+                                  | LL_DMA_MEMORY_INCREMENT
+                                  | LL_DMA_PDATAALIGN_BYTE
+                                  | LL_DMA_MDATAALIGN_BYTE
+                                  | LL_DMA_PRIORITY_MEDIUM);
+        LL_DMA_ConfigAddresses(d->dma, d->stream,
+                               LL_USART_DMA_GetRegAddr(u->name),
+                               (uint32_t)u->ring.buf,
+                               LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+        LL_DMA_SetDataLength(d->dma, d->stream, UART_RX_RING_SIZE);
+        // HT/TC нужны, чтобы кольцо не переполнилось на длинной посылке без паузы
+        LL_DMA_EnableIT_HT(d->dma, d->stream);
+        LL_DMA_EnableIT_TC(d->dma, d->stream);
+        LL_DMA_EnableStream(d->dma, d->stream);
+
+        LL_USART_EnableDMAReq_RX(u->name);
+        LL_USART_ClearFlag_IDLE(u->name);
+        LL_USART_EnableIT_IDLE(u->name);
+    }
+#endif
+
+#ifdef UART_USE_DMA_TX
+    for (uint32_t i = 0; i < UART_COUNT; i++) {
+        const struct uart_dma *d = &uart_dma_tx[i];
+        if (d->dma == 0) {
+            continue;
+        }
+        struct uart *u = &uarts[i];
+        u->tx_dma = d;
+
+        NVIC_SetPriority(d->irqn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0));
+        NVIC_EnableIRQ(d->irqn);
+
+        LL_DMA_SetChannelSelection(d->dma, d->stream, d->channel);
+        LL_DMA_ConfigTransfer(d->dma, d->stream,
+                              LL_DMA_DIRECTION_MEMORY_TO_PERIPH
+                                  | LL_DMA_MODE_NORMAL
+                                  | LL_DMA_PERIPH_NOINCREMENT
+                                  | LL_DMA_MEMORY_INCREMENT
+                                  | LL_DMA_PDATAALIGN_BYTE
+                                  | LL_DMA_MDATAALIGN_BYTE
+                                  | LL_DMA_PRIORITY_MEDIUM);
+        LL_DMA_SetPeriphAddress(d->dma, d->stream, LL_USART_DMA_GetRegAddr(u->name));
+        LL_DMA_EnableIT_TC(d->dma, d->stream);
+
+        LL_USART_EnableDMAReq_TX(u->name);
+    }
+#endif
+}
+
+uint32_t uart_cfg_is_valid(const struct uart_cfg *cfg)
+{
+    return (cfg->baudrate >= UART_BAUDRATE_MIN)
+        && (cfg->baudrate <= UART_BAUDRATE_MAX)
+        && (cfg->parity < arr_len(uart_ll_parity))
+        && (cfg->stop_bits >= 1)
+        && (cfg->stop_bits <= 2)
+        && (cfg->over8 <= 1);
+}
+
+uint32_t uart_set_cfg(struct uart *u, const struct uart_cfg *cfg)
+{
+    if (!uart_cfg_is_valid(cfg)) {
+        return 0;
+    }
+    u->cfg = *cfg;
+    uart_apply_cfg(u);
+    return 1;
+}
+
+void uart_apply_cfg(struct uart *u)
+{
+    const struct uart_cfg *c = &u->cfg;
+    // Бит четности занимает девятый бит кадра, данных остается 8
+    LL_USART_InitTypeDef USART_InitStruct = {
+        .BaudRate = c->baudrate,
+        .DataWidth = (c->parity == UART_PARITY_NONE) ? LL_USART_DATAWIDTH_8B
+                                                     : LL_USART_DATAWIDTH_9B,
+        .StopBits = (c->stop_bits == 2) ? LL_USART_STOPBITS_2
+                                        : LL_USART_STOPBITS_1,
+        .Parity = uart_ll_parity[c->parity],
+        .TransferDirection = LL_USART_DIRECTION_TX_RX,
+        .HardwareFlowControl = LL_USART_HWCONTROL_NONE,
+        .OverSampling = c->over8 ? LL_USART_OVERSAMPLING_8
+                                 : LL_USART_OVERSAMPLING_16,
+    };
+    LL_USART_Disable(u->name);
+    LL_USART_Init(u->name, &USART_InitStruct);
+    LL_USART_ConfigAsyncMode(u->name);
+    LL_USART_Enable(u->name);
+}
+
+// Время приема size байт на текущей скорости, мс, с запасом 2 мс
+static uint16_t uart_recv_timeout_ms(struct uart *u, uint32_t size)
+{
+    const struct uart_cfg *c = &u->cfg;
+    uint32_t bits = 1 + 8 + (c->parity != UART_PARITY_NONE) + c->stop_bits;
+    return (size * bits * 1000 + c->baudrate - 1) / c->baudrate + 2;
+}
+
+void uart_stat_reset(void)
+{
+    for (uint32_t i = 0; i < UART_COUNT; i++) {
+        uarts[i].stat = (struct uart_stat){0};
+    }
+}
+
 void uart_send_array(struct uart *u, void *data, uint32_t size)
 {
     u->tx.data = data;
     u->tx.count = size;
+    u->tx_is_open = 0;
     LL_GPIO_SetOutputPin(u->de.port, u->de.pin);
+    if (u->tx_dma) {
+        const struct uart_dma *d = u->tx_dma;
+        LL_USART_EnableDMAReq_TX(u->name);
+        LL_DMA_DisableStream(d->dma, d->stream);
+        while (LL_DMA_IsEnabledStream(d->dma, d->stream)) {
+        }
+        dma_clear_flags(d);
+        LL_DMA_SetMemoryAddress(d->dma, d->stream, (uint32_t)data);
+        LL_DMA_SetDataLength(d->dma, d->stream, size);
+        // DMA пишет в DR без чтения SR, поэтому TC сбрасываем сами
+        LL_USART_ClearFlag_TC(u->name);
+        LL_DMA_EnableStream(d->dma, d->stream);
+        LL_USART_EnableIT_TC(u->name);
+        return;
+    }
     LL_USART_EnableIT_TXE(u->name);
     LL_USART_EnableIT_TC(u->name);
 }
 
+// Передача посылки, которая еще принимается: байты добавляются
+// uart_send_append по мере готовности, всегда через TXE, конец - uart_send_end
+void uart_send_begin(struct uart *u, void *data, uint32_t size)
+{
+    u->tx.data = data;
+    u->tx.count = size;
+    u->tx_is_open = 1;
+    LL_GPIO_SetOutputPin(u->de.port, u->de.pin);
+    if (u->tx_dma) {
+        LL_USART_DisableDMAReq_TX(u->name);
+    }
+    LL_USART_EnableIT_TXE(u->name);
+}
+
+void uart_send_append(struct uart *u, uint32_t size)
+{
+    // Вызывается из прерываний того же приоритета, что и TXE
+    if (size == 0) {
+        return;
+    }
+    u->tx.count += size;
+    LL_USART_EnableIT_TXE(u->name);
+}
+
+void uart_send_end(struct uart *u)
+{
+    u->tx_is_open = 0;
+    LL_USART_EnableIT_TC(u->name);
+}
+
+void uart_send_abort(struct uart *u)
+{
+    LL_USART_DisableIT_TXE(u->name);
+    u->tx.count = 0;
+    uart_send_end(u);
+}
+
+uint32_t uart_tx_is_busy(struct uart *u)
+{
+    return (u->tx.count != 0)
+        || u->tx_is_open
+        || LL_USART_IsEnabledIT_TC(u->name);
+}
+
 void uart_recv_array(struct uart *u, void *data, uint32_t size)
 {
     u->rx.data = data;
     u->rx.count = size;
-    // 115200 / 1000 / (1 + 8 + 1) = 11.2 >~ 8
-    // 19200 / 1000 / (1 + 8 + 1) = 1.92 >~ 1
-    u->timeout.ms = size / 1 + 2; 
+    u->timeout.ms = uart_recv_timeout_ms(u, size);
+    if (u->ring.dma) {
+        // Данные уже приходят в кольцо, разбор по IDLE/HT/TC
+        return;
+    }
     LL_USART_EnableIT_RXNE(u->name);
 }
 
+// Разбор кольца DMA не только по IDLE, но и каждую мс по таймеру
+void uart_recv_poll(struct uart *u, uint32_t enable)
+{
+    if (u->ring.dma) {
+        u->ring.poll = enable;
+    }
+}
+
 void uart_stop_recv(struct uart *u)
 {
-    LL_USART_DisableIT_RXNE(u->name);   
-    u->timeout.is_enable = 0; 
+    if (u->ring.dma) {
+        u->rx.count = 0;
+        u->ring.tail = uart_ring_head(u);
+    } else {
+        LL_USART_DisableIT_RXNE(u->name);
+    }
+    u->timeout.is_enable = 0;
 }
 
 void uart_irq_callback(struct uart *u)
 {
+    uart_stat_begin();
     USART_TypeDef *name = u->name;
     if (LL_USART_IsEnabledIT_RXNE(name) && LL_USART_IsActiveFlag_RXNE(name)) {
-        u->timeout.is_enable = 1;        
+        u->timeout.is_enable = 1;
         *u->rx.data++ = LL_USART_ReceiveData8(name);
         u->rx.count--;
+        uart_recv_data_callback(u, 1);
         if (u->rx.count == 0) {
             uart_stop_recv(u);
             uart_recv_complete_callback(u);
         }
     }
+    if (LL_USART_IsEnabledIT_IDLE(name) && LL_USART_IsActiveFlag_IDLE(name)) {
+        LL_USART_ClearFlag_IDLE(name);
+        uart_ring_drain(u);
+    }
     if (LL_USART_IsEnabledIT_TXE(name) && LL_USART_IsActiveFlag_TXE(name)) {
         LL_USART_TransmitData8(name, *u->tx.data++);
         u->tx.count--;
@@ -69,17 +397,50 @@ void uart_irq_callback(struct uart *u)
     if (LL_USART_IsEnabledIT_TC(name) && LL_USART_IsActiveFlag_TC(name)) {
         LL_USART_ClearFlag_TC(name);
         LL_USART_DisableIT_TC(name);
+        u->tx.count = 0;
         LL_GPIO_ResetOutputPin(u->de.port, u->de.pin);
         uart_send_complete_callback(u);
     }
+    if (u->ring.poll) {
+        uart_ring_drain(u);
+    }
+    uart_stat_end(u);
+}
+
+void uart_dma_rx_irq_callback(struct uart *u)
+{
+    uart_stat_begin();
+    dma_clear_flags(u->ring.dma);
+    uart_ring_drain(u);
+    uart_stat_end(u);
+}
+
+void uart_dma_tx_irq_callback(struct uart *u)
+{
+    uart_stat_begin();
+    dma_clear_flags(u->tx_dma);
+    // В DR лежит последний байт, еще один в сдвиговом регистре: если
+    // обработчик сразу запустит следующую передачу, паузы на линии не будет
+    uart_send_dma_complete_callback(u);
+    uart_stat_end(u);
+}
+
+uint32_t uart_get_ms(void)
+{
+    return uart_ms;
 }
 
 void tim6_update_callback()
 {
+    uart_ms++;
     for (uint32_t i = 0; i < UART_COUNT; i++) {
         struct uart *u = &uarts[i];
+        if (u->ring.poll) {
+            // Разбор в прерывании USART, чтобы не пересекаться с IDLE
+            NVIC_SetPendingIRQ(u->irqn);
+        }
         if (u->timeout.is_enable) {
-           if (--u->timeout.ms == 0) {                
+           if (--u->timeout.ms == 0) {
                 uart_recv_timeout_callback(u);
             }
         }
@@ -91,6 +452,17 @@ __WEAK void uart_send_complete_callback(struct uart *u)
     (void)u;
 }
 
+__WEAK void uart_send_dma_complete_callback(struct uart *u)
+{
+    (void)u;
+}
+
+__WEAK void uart_recv_data_callback(struct uart *u, uint32_t count)
+{
+    (void)u;
+    (void)count;
+}
+
 __WEAK void uart_recv_complete_callback(struct uart *u)
 {
     (void)u;
@@ -1,8 +1,249 @@
 import serial
 import crcmod
+import struct
 
 crc16 = crcmod.mkCrcFun(0x18005, rev=True, initCrc=0xFFFF, xorOut=0x0000)
 
+# Frame formats of the expander (Core/Src/aura.c, Core/Inc/chunk.h)
+AURA_MAGIC = b'AURA'
+AURA_V2_MAGIC = 0xA2
+AURA_HDR_SIZE = 20
+AURA_MAX_DATA_SIZE = 128
+
+CMD_ANS_WHOAMI = 2
+CMD_ANS_DATA = 4
+CMD_ANS_BUSY = 10
+CMD_REQ_GATHER = 11
+CMD_ANS_GATHER = 12
+CMD_ANS_CONTAINER = 14
+CMD_REQ_BULK = 15
+CMD_FLAG_SRC_ROUTE = 0x8000
+
+CHUNK_TYPE_U8 = 2
+CHUNK_TYPE_U16 = 4
+CHUNK_TYPE_U32 = 6
+CHUNK_TYPE_F32 = 7
+CHUNK_TYPE_ARR_U8 = 11
+CHUNK_TYPE_ARR_U16 = 13
+CHUNK_TYPE_ARR_U32 = 15
+
+CHUNK_ID_TYPE = 1
+CHUNK_ID_UIDS = 2
+CHUNK_ID_BUSY = 17
+CHUNK_ID_GATHER_CMD = 22
+CHUNK_ID_GATHER_MS = 23
+CHUNK_ID_GATHER_DEV = 24
+CHUNK_ID_GATHER_END = 25
+CHUNK_ID_FRAME = 26
+CHUNK_ID_BULK_REQ = 28
+CHUNK_ID_FRAME_CRC32 = 32
+CHUNK_ID_FRAME_V2 = 33
+CHUNK_ID_LINK_ADDRS = 34
+CHUNK_ID_CONTAINER_MTU = 35
+
+# v2 link addresses: 0 - broadcast, 1 - master, 2 - expander,
+# 3.. - devices behind the expander, read with CHUNK_ID_LINK_ADDRS
+LINK_ADDR_FIRST = 3
+link_uids = {0: 0}
+
+# CHUNK_ID_FRAME_CRC32 bit 0 set: frames on the line end with the crc32
+# of the STM32 CRC unit instead of crc16
+use_crc32 = False
+
+def crc32_stm32(buf):
+    crc = 0xFFFFFFFF
+    buf = bytes(buf) + bytes(-len(buf) % 4)
+    for i in range(0, len(buf), 4):
+        crc ^= int.from_bytes(buf[i:i+4], 'little')
+        for b in range(32):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+            crc &= 0xFFFFFFFF
+    return crc
+
+def pack_make(cmd, uid_dest=0, data=b'', cnt=0, uid_src=0):
+    p = bytearray(AURA_MAGIC)
+    p.extend(cnt.to_bytes(4,'little'))
+    p.extend(uid_src.to_bytes(4,'little'))
+    p.extend(uid_dest.to_bytes(4,'little'))
+    p.extend(cmd.to_bytes(2,'little'))
+    p.extend(len(data).to_bytes(2,'little'))
+    p.extend(data)
+    p.extend(crc16(p).to_bytes(2,'little'))
+    return p
+
+def chunk_make(id, type, payload):
+    return bytes([id, type]) + len(payload).to_bytes(2,'little') + bytes(payload)
+
+def chunk_u16(id, val):
+    return chunk_make(id, CHUNK_TYPE_U16, val.to_bytes(2,'little'))
+
+def chunk_u32(id, val):
+    return chunk_make(id, CHUNK_TYPE_U32, val.to_bytes(4,'little'))
+
+# (id, type, payload) for each chunk; a chunk running past the end stops the list
+def chunks_parse(data):
+    chunks = []
+    pos = 0
+    while pos + 4 <= len(data):
+        size = int.from_bytes(data[pos+2:pos+4], 'little')
+        if pos + 4 + size > len(data):
+            break
+        chunks.append((data[pos], data[pos+1], bytes(data[pos+4:pos+4+size])))
+        pos += 4 + size
+    return chunks
+
+def chunk_value(type, payload):
+    if type in (CHUNK_TYPE_U8, CHUNK_TYPE_U16, CHUNK_TYPE_U32):
+        return int.from_bytes(payload, 'little')
+    if type == CHUNK_TYPE_F32:
+        return struct.unpack('<f', payload)[0]
+    if type == CHUNK_TYPE_ARR_U16:
+        return [int.from_bytes(payload[i:i+2], 'little') for i in range(0, len(payload) - 1, 2)]
+    if type == CHUNK_TYPE_ARR_U32:
+        return [int.from_bytes(payload[i:i+4], 'little') for i in range(0, len(payload) - 3, 4)]
+    return payload
+
+def varint_get(buf, pos):
+    val = 0
+    shift = 0
+    while True:
+        if pos >= len(buf):
+            return None, pos
+        byte = buf[pos]
+        pos += 1
+        val |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return val, pos
+
+# Header of a frame at the start of buf: (header size, dict) or (0, None)
+# while bytes are missing; None in the dict - the header is invalid
+def header_parse(buf):
+    if buf[:1] == bytes([AURA_V2_MAGIC]):
+        if len(buf) < 3:
+            return 0, None
+        cnt, pos = varint_get(buf, 3)
+        cmd, pos = varint_get(buf, pos)
+        data_sz, pos = varint_get(buf, pos)
+        if data_sz is None:
+            return (0, None) if pos >= len(buf) else (1, {'bad': True})
+        return pos, {'v2': True, 'cnt': cnt, 'cmd': cmd, 'data_sz': data_sz,
+                     'uid_src': link_uids.get(buf[1]), 'uid_dest': link_uids.get(buf[2]),
+                     'addr_src': buf[1], 'addr_dest': buf[2]}
+    if len(buf) < AURA_HDR_SIZE:
+        return 0, None
+    return AURA_HDR_SIZE, {'v2': False,
+                           'cnt': int.from_bytes(buf[4:8], 'little'),
+                           'uid_src': int.from_bytes(buf[8:12], 'little'),
+                           'uid_dest': int.from_bytes(buf[12:16], 'little'),
+                           'cmd': int.from_bytes(buf[16:18], 'little'),
+                           'data_sz': int.from_bytes(buf[18:20], 'little')}
+
+# First frame in buf: (frame, bytes consumed). (None, 0) - wait for more
+# bytes, (None, n) - n bytes before the next frame start are skipped
+def frame_parse(buf, crc32=False, v2=False):
+    start = 0
+    while start < len(buf):
+        if buf[start:start+4] == AURA_MAGIC[:len(buf) - start]:
+            break
+        if v2 and buf[start] == AURA_V2_MAGIC:
+            break
+        start += 1
+    if start != 0:
+        return None, start
+    hdr_size, f = header_parse(buf)
+    if f is None:
+        return None, 0
+    if f.get('bad') or f['data_sz'] > AURA_MAX_DATA_SIZE:
+        return None, 1
+    body = hdr_size + f['data_sz']
+    size = body + (4 if crc32 else 2)
+    if len(buf) < size:
+        return None, 0
+    if crc32:
+        is_valid = crc32_stm32(buf[:body]) == int.from_bytes(buf[body:size], 'little')
+    else:
+        is_valid = crc16(bytes(buf[:size])) == 0
+    if not is_valid:
+        return None, 1
+    f['data'] = bytes(buf[hdr_size:body])
+    return f, size
+
+# A container carries whole frames with crc16 in CHUNK_ID_FRAME chunks
+def frame_unpack(f):
+    if f['cmd'] != CMD_ANS_CONTAINER:
+        return [f]
+    frames = []
+    for id, type, payload in chunks_parse(f['data']):
+        if id != CHUNK_ID_FRAME:
+            continue
+        inner, size = frame_parse(payload, v2=f['v2'])
+        if inner is None or size != len(payload):
+            print('bad frame in container:', payload.hex(' '))
+            continue
+        frames.extend(frame_unpack(inner))
+    return frames
+
+def chunks_describe(data):
+    s = []
+    for id, type, payload in chunks_parse(data):
+        val = chunk_value(type, payload)
+        if id == CHUNK_ID_LINK_ADDRS and len(val) >= 2:
+            # generation, first address, uid of each address from it on
+            for i, uid in enumerate(val[2:]):
+                if uid:
+                    link_uids[val[1] + i] = uid
+                else:
+                    link_uids.pop(val[1] + i, None)
+        if isinstance(val, list):
+            val = '[' + ' '.join(format(x, '08x') for x in val) + ']'
+        elif isinstance(val, bytes):
+            val = val.hex(' ')
+        s.append('%d:%s' % (id, val))
+    return ' '.join(s)
+
+def frame_describe(f):
+    uid = lambda x: '?' if x is None else format(x, '08x')
+    s = '%s cnt %d %s -> %s cmd %d' % ('v2' if f['v2'] else 'v1', f['cnt'],
+                                     uid(f['uid_src']), uid(f['uid_dest']), f['cmd'])
+    if f['cmd'] == CMD_ANS_BUSY:
+        # The expander lost a request or an answer of uid, count - how many
+        for id, type, payload in chunks_parse(f['data']):
+            if id == CHUNK_ID_BUSY:
+                busy = chunk_value(type, payload)
+                s += ' busy uid %08x lost %d' % (busy[0], busy[1])
+        return s
+    if f['cmd'] == CMD_ANS_GATHER:
+        for id, type, payload in chunks_parse(f['data']):
+            if id == CHUNK_ID_GATHER_DEV:
+                dev = int.from_bytes(payload[:4], 'little')
+                s += '\n  dev %08x: %s' % (dev, chunks_describe(payload[4:]))
+            elif id == CHUNK_ID_GATHER_END:
+                s += '\n  end, %d devices' % chunk_value(type, payload)
+        return s
+    return s + ' ' + chunks_describe(f['data'])
+
+# Frames from the port until it is silent for ser.timeout
+def frames_read(ser, v2=False):
+    buf = bytearray()
+    while True:
+        data = ser.read(max(1, ser.in_waiting))
+        if not data:
+            if buf:
+                print('dropped:', buf.hex(' '))
+            return
+        buf.extend(data)
+        while buf:
+            f, n = frame_parse(buf, use_crc32, v2)
+            if f is None and n == 0:
+                break
+            if f is None:
+                print('skipped:', buf[:n].hex(' '))
+            else:
+                for inner in frame_unpack(f):
+                    yield inner
+            del buf[:n]
+
 #whoami
 cmd_whoami = bytearray('AURA'.encode())
 cmd_whoami.extend(bytearray([1]))
@@ -58,15 +299,21 @@ ser.timeout = 1
 ser.open()
 
 ser.write(cmd_whoami)
-response  = ser.read(20+8+2) #whoami from temp sens
-print(' '.join(format(x, '02x') for x in response))
+for f in frames_read(ser):
+    print(frame_describe(f))
 
 # ser.write (cmd_whoami)
 # ser.write(crc16(cmd_whoami).to_bytes(2,'little'))
 for i in range (10):
     ser.write(cmd_data)
-    response  = ser.read(20+8+2) #whoami from temp sens
-    print(' '.join(format(x, '02x') for x in response))
+    for f in frames_read(ser):
+        print(frame_describe(f))
+
+# all devices answer in CMD_ANS_GATHER frames of the expander
+# ser.write(pack_make(CMD_REQ_GATHER, uid_dest=0x1CE83461,
+#                     data=chunk_u16(CHUNK_ID_GATHER_MS, 200)))
+# for f in frames_read(ser):
+#     print(frame_describe(f))
 
 # for i in range(2):
 #     if i%2 == 0:
@@ -0,0 +1,283 @@
+// Прием aura.c от мастера на ПК: поток посылок с перевернутыми битами,
+// обрывами и мусором между посылками проходит через разбор побайтно,
+// как из прерывания RXNE; считается, сколько целых посылок восстановлено.
+// Сборка из vscode/test (aura.c хранит адреса в uint32_t, поэтому -no-pie):
+//   gcc -O2 -std=gnu11 -no-pie -Istub -I../../Core/Inc -Wno-pointer-to-int-cast
+//       -Wno-int-to-pointer-cast aura_replay_test.c ../../Core/Src/crc16.c -o aura_replay_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../Core/Src/aura.c"
+
+#define FRAMES      200000
+#define STREAM_SIZE (FRAMES * (sizeof(struct pack) + 64))
+#define FIND_ROUNDS 1000000
+
+struct uart uarts[UART_COUNT];
+
+// Драйвер: прием в буфер по одному байту, остальное не нужно
+
+void uart_recv_array(struct uart *u, void *data, uint32_t size)
+{
+    u->rx.data = data;
+    u->rx.count = size;
+}
+
+void uart_stop_recv(struct uart *u)
+{
+    u->rx.count = 0;
+    u->timeout.is_enable = 0;
+}
+
+void uart_send_array(struct uart *u, void *data, uint32_t size) {}
+void uart_send_begin(struct uart *u, void *data, uint32_t size) {}
+void uart_send_append(struct uart *u, uint32_t size) {}
+void uart_send_end(struct uart *u) {}
+void uart_send_abort(struct uart *u) {}
+uint32_t uart_tx_is_busy(struct uart *u) { return 0; }
+void uart_recv_poll(struct uart *u, uint32_t enable) {}
+uint32_t uart_cfg_is_valid(const struct uart_cfg *cfg) { return 1; }
+uint32_t uart_set_cfg(struct uart *u, const struct uart_cfg *cfg) { return 1; }
+void uart_apply_cfg(struct uart *u) {}
+void uart_stat_reset(void) {}
+uint32_t uart_get_ms(void) { return 0; }
+uint16_t sens_get_state(void) { return 0; }
+uint16_t bat_get_voltage(void) { return 0; }
+uint32_t uid_hash(void) { return 0x12345678; }
+void autobaud_start(void) {}
+uint32_t autobaud_is_running(void) { return 0; }
+void crc32_init(void) {}
+crc32_t crc32_calc(const void *buf, uint32_t size) { return 0; }
+
+static uint8_t stream[STREAM_SIZE];
+static uint32_t stream_size;
+
+// Смещения начала и размеры целых посылок в потоке
+static uint32_t sent_pos[FRAMES];
+static uint32_t sent_size[FRAMES];
+static uint32_t sent_count;
+// Перед посылкой была пауза: прием начинается с чистого листа
+static uint8_t sent_after_gap[FRAMES];
+// Позиции пауз на линии
+static uint32_t gaps[FRAMES * 2];
+static uint32_t gaps_count;
+
+static uint32_t got[FRAMES];
+static uint32_t bad_count;
+
+static void stream_put(const void *data, uint32_t size)
+{
+    memcpy(&stream[stream_size], data, size);
+    stream_size += size;
+}
+
+static void stream_gap(void)
+{
+    if ((gaps_count == 0) || (gaps[gaps_count - 1] != stream_size)) {
+        gaps[gaps_count++] = stream_size;
+    }
+}
+
+// Посылка мастеру от соседа: номер посылки в cnt
+static uint32_t frame_make(struct pack *p, uint32_t n)
+{
+    static const struct pack pack_empty = {
+        .header = {.protocol = AURA_PROTOCOL},
+    };
+    memcpy(p, &pack_empty, sizeof(*p));
+    p->header.cnt = n;
+    p->header.uid_src = rand();
+    p->header.uid_dest = 1 + rand() % 0xFFFF;
+    p->header.cmd = (rand() & 0x7FFF) | 1;
+    p->header.data_sz = rand() % (AURA_MAX_DATA_SIZE + 1);
+    for (uint32_t i = 0; i < p->header.data_sz; i++) {
+        p->data[i] = rand();
+    }
+    uint32_t size = aura_pack_size(p);
+    crc16_add2pack(p, size);
+    return size;
+}
+
+// Мусор с обрывками магического слова
+static void garbage_put(void)
+{
+    uint32_t size = 1 + rand() % 40;
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t b = rand();
+        if (rand() % 4 == 0) {
+            b = (uint8_t)(AURA_PROTOCOL >> (8 * (rand() % 4)));
+        }
+        stream_put(&b, 1);
+    }
+}
+
+static void stream_build(void)
+{
+    static struct pack p;
+    for (uint32_t n = 0; n < FRAMES; n++) {
+        uint32_t size = frame_make(&p, n);
+        uint32_t kind = rand() % 10;
+        if (rand() % 2) {
+            stream_gap();
+        }
+        uint32_t after_gap = (gaps_count != 0) && (gaps[gaps_count - 1] == stream_size);
+        if (kind < 5) {
+            sent_pos[sent_count] = stream_size;
+            sent_size[sent_count] = size;
+            sent_after_gap[sent_count++] = after_gap;
+            stream_put(&p, size);
+        } else if (kind < 7) {
+            // 1..3 разных перевернутых бита где угодно, в том числе в заголовке
+            uint32_t bits[3];
+            uint32_t count = 1 + rand() % 3;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t is_new;
+                do {
+                    bits[i] = rand() % (size * 8);
+                    is_new = 1;
+                    for (uint32_t j = 0; j < i; j++) {
+                        is_new &= (bits[j] != bits[i]);
+                    }
+                } while (!is_new);
+                ((uint8_t *)&p)[bits[i] / 8] ^= 1 << (bits[i] % 8);
+            }
+            stream_put(&p, size);
+        } else if (kind < 9) {
+            // Обрыв передачи: остаток не приходит, дальше пауза
+            stream_put(&p, rand() % size);
+            stream_gap();
+        } else {
+            garbage_put();
+        }
+    }
+    stream_gap();
+}
+
+// Разобранное попадает в master_fifo; оно сверяется с отправленным
+static void master_drain(void)
+{
+    while (fifo_is_nonempty(master_fifo)) {
+        struct pack *p = (struct pack *)fifo_pop(master_fifo);
+        uint32_t n = p->header.cnt;
+        uint32_t size = aura_pack_size(p);
+        uint32_t i = 0;
+        uint32_t j = sent_count;
+        // sent_* упорядочены по номеру посылки
+        while (i < j) {
+            uint32_t m = (i + j) / 2;
+            if (((struct pack *)&stream[sent_pos[m]])->header.cnt < n) {
+                i = m + 1;
+            } else {
+                j = m;
+            }
+        }
+        if ((i < sent_count) && (sent_size[i] == size)
+            && (memcmp(&stream[sent_pos[i]], p, size) == 0)) {
+            got[i]++;
+        } else {
+            bad_count++;
+        }
+    }
+}
+
+static uint32_t replay(void)
+{
+    struct uart *u = &uarts[0];
+    uint32_t g = 0;
+    uint32_t lost_bytes = 0;
+    // Скорость известна: автоподбор не запускается, прием сразу
+    autobaud_errors_max = 0;
+    aura_init();
+    aura_recv_package(0);
+    for (uint32_t i = 0; i < stream_size; i++) {
+        for (; (g < gaps_count) && (gaps[g] == i); g++) {
+            if (u->timeout.is_enable) {
+                uart_recv_timeout_callback(u);
+            }
+        }
+        if (u->rx.count == 0) {
+            lost_bytes++;
+            continue;
+        }
+        u->timeout.is_enable = 1;
+        *u->rx.data++ = stream[i];
+        u->rx.count--;
+        uart_recv_data_callback(u, 1);
+        if (u->rx.count == 0) {
+            uart_stop_recv(u);
+            uart_recv_complete_callback(u);
+        }
+        master_drain();
+    }
+    if (u->timeout.is_enable) {
+        uart_recv_timeout_callback(u);
+    }
+    master_drain();
+
+    uint32_t recovered = 0;
+    uint32_t after_gap = 0;
+    uint32_t lost_after_gap = 0;
+    uint32_t twice = 0;
+    for (uint32_t i = 0; i < sent_count; i++) {
+        recovered += (got[i] != 0);
+        twice += (got[i] > 1);
+        after_gap += sent_after_gap[i];
+        lost_after_gap += sent_after_gap[i] && (got[i] == 0);
+    }
+    printf("stream %u bytes, %u frames, %u intact\n", stream_size, FRAMES, sent_count);
+    printf("recovered %u of %u intact (%.2f%%), after a gap %u of %u\n",
+           recovered, sent_count, 100.0 * recovered / sent_count,
+           after_gap - lost_after_gap, after_gap);
+    printf("accepted corrupted %u, twice %u, rx_resync %u, bytes unread %u\n",
+           bad_count, twice, aura_stat.rx_resync, lost_bytes);
+    // Пауза перед целой посылкой всегда возвращает прием к ее началу,
+    // а испорченная посылка не проходит crc16
+    return (lost_after_gap != 0) + (bad_count != 0) + (twice != 0);
+}
+
+// Поиск по 4 байта против побайтного
+static uint32_t magic_find_ref(const uint8_t *buf, uint32_t from, uint32_t size)
+{
+    for (uint32_t i = from; i < size; i++) {
+        uint32_t j = 0;
+        while ((i + j < size) && (j < sizeof(uint32_t))
+               && (buf[i + j] == (uint8_t)(AURA_PROTOCOL >> (8 * j)))) {
+            j++;
+        }
+        if ((i + j == size) || (j == sizeof(uint32_t))) {
+            return i;
+        }
+    }
+    return size;
+}
+
+static uint32_t test_magic_find(void)
+{
+    static const uint8_t magic[] = {'A', 'U', 'R', 'A'};
+    uint8_t buf[64];
+    uint32_t errors = 0;
+    for (uint32_t n = 0; n < FIND_ROUNDS; n++) {
+        uint32_t size = rand() % sizeof(buf);
+        for (uint32_t i = 0; i < size; i++) {
+            buf[i] = (rand() % 2) ? magic[rand() % 4] : rand();
+        }
+        uint32_t from = (size == 0) ? 0 : rand() % (size + 1);
+        errors += (aura_magic_find(buf, from, size) != magic_find_ref(buf, from, size));
+    }
+    printf("aura_magic_find: %u errors\n", errors);
+    return errors;
+}
+
+int main(void)
+{
+    srand(1);
+    if ((uintptr_t)&master_packs[0] >> 32) {
+        printf("build with -no-pie: aura.c keeps addresses in uint32_t\n");
+        return 1;
+    }
+    uint32_t errors = test_magic_find();
+    stream_build();
+    errors += replay();
+    printf("%s\n", errors ? "FAIL" : "OK");
+    return errors != 0;
+}
@@ -0,0 +1,146 @@
+// Проверка crc16.c на ПК: таблица по 8 байт, crc16_get/crc16_set и
+// crc16_patch сверяются с побитовым расчетом, плюс скорость на байт.
+// Сборка из vscode/test:
+//   gcc -O2 -std=gnu11 -Istub -I../../Core/Inc crc16_test.c ../../Core/Src/crc16.c -o crc16_test
+// На плате такты на байт дает crc16_bench при CRC16_BENCH в crc16.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "crc16.h"
+
+#define BUF_SIZE   300
+#define ROUNDS     100000
+#define BENCH_SIZE (1024 * 1024)
+
+extern const uint16_t crc16_tab[256];
+
+// Эталон: CRC-16/MODBUS побитно, без таблиц
+static crc16_t crc16_ref(crc16_t crc, const uint8_t *buf, uint32_t size)
+{
+    while (size--) {
+        crc ^= *buf++;
+        for (uint32_t i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+// Прежний расчет: одна таблица, байт за шагом
+static crc16_t crc16_bytewise(crc16_t crc, const uint8_t *buf, uint32_t size)
+{
+    while (size--) {
+        crc = crc16_tab[(crc ^ (*buf++)) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void buf_random(uint8_t *buf, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        buf[i] = rand();
+    }
+}
+
+static uint32_t test_calc(void)
+{
+    uint8_t buf[BUF_SIZE];
+    uint32_t errors = 0;
+    for (uint32_t n = 0; n < ROUNDS; n++) {
+        uint32_t size = rand() % BUF_SIZE;
+        buf_random(buf, size);
+        crc16_t ref = crc16_ref(0xFFFF, buf, size);
+        errors += (crc16_calc(buf, size) != ref);
+        errors += (crc16_bytewise(0xFFFF, buf, size) != ref);
+        // Тот же результат при расчете кусками с произвольной границей
+        uint32_t split = (size == 0) ? 0 : rand() % (size + 1);
+        crc16_t crc = crc16_calc_continue(0xFFFF, buf, split);
+        errors += (crc16_calc_continue(crc, &buf[split], size - split) != ref);
+    }
+    printf("crc16_calc:     %u errors\n", errors);
+    return errors;
+}
+
+static uint32_t test_get_set(void)
+{
+    uint8_t buf[BUF_SIZE + sizeof(crc16_t)];
+    uint32_t errors = 0;
+    for (uint32_t n = 0; n < ROUNDS; n++) {
+        uint32_t size = rand() % BUF_SIZE;
+        buf_random(buf, size);
+        // Посылка закрывается по частям, как ответ WHOAMI с дописанным uid
+        uint32_t split = (size == 0) ? 0 : rand() % (size + 1);
+        crc16_t crc = crc16_calc_continue(0xFFFF, buf, split);
+        crc16_set(buf, size, crc16_calc_continue(crc, &buf[split], size - split));
+        errors += (crc16_get(buf, size) != crc16_ref(0xFFFF, buf, size));
+        errors += !crc16_is_valid(buf, size + sizeof(crc16_t));
+        crc16_add2pack(buf, size + sizeof(crc16_t));
+        errors += !crc16_is_valid(buf, size + sizeof(crc16_t));
+    }
+    printf("crc16_get/set:  %u errors\n", errors);
+    return errors;
+}
+
+static uint32_t test_patch(void)
+{
+    uint8_t buf[BUF_SIZE];
+    uint8_t old[BUF_SIZE];
+    uint32_t errors = 0;
+    for (uint32_t n = 0; n < ROUNDS; n++) {
+        uint32_t size = 1 + rand() % (BUF_SIZE - 1);
+        buf_random(buf, size);
+        crc16_t crc = crc16_calc(buf, size);
+        uint32_t offset = rand() % size;
+        uint32_t len = 1 + rand() % (size - offset);
+        for (uint32_t i = 0; i < len; i++) {
+            old[i] = buf[offset + i];
+        }
+        buf_random(&buf[offset], len);
+        crc = crc16_patch(crc, size, offset, old, &buf[offset], len);
+        errors += (crc != crc16_ref(0xFFFF, buf, size));
+    }
+    printf("crc16_patch:    %u errors\n", errors);
+    return errors;
+}
+
+static double bench_ns(crc16_t (*calc)(crc16_t, const void *, uint32_t),
+                       const uint8_t *buf, uint32_t size)
+{
+    struct timespec t0, t1;
+    volatile crc16_t crc;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint32_t n = 0; n < 16; n++) {
+        crc = calc(0xFFFF, buf, size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    (void)crc;
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    return ns / (16.0 * size);
+}
+
+static crc16_t bench_bytewise(crc16_t crc, const void *buf, uint32_t size)
+{
+    return crc16_bytewise(crc, buf, size);
+}
+
+static void bench(void)
+{
+    static uint8_t buf[BENCH_SIZE];
+    buf_random(buf, sizeof(buf));
+    printf("bytewise:       %.2f ns/byte\n", bench_ns(bench_bytewise, buf, sizeof(buf)));
+    printf("slice-by-8:     %.2f ns/byte\n", bench_ns(crc16_calc_continue, buf, sizeof(buf)));
+}
+
+int main(void)
+{
+    srand(1);
+    // Контрольное значение CRC-16/MODBUS для "123456789"
+    uint32_t errors = (crc16_calc("123456789", 9) != 0x4B37);
+    errors += test_calc();
+    errors += test_get_set();
+    errors += test_patch();
+    bench();
+    printf("%s\n", errors ? "FAIL" : "OK");
+    return errors != 0;
+}
@@ -0,0 +1,137 @@
+// Проверка dict.h на ПК: стоимость поиска против прежнего перебора
+// массива и случайные добавления/удаления против эталона.
+// Сборка из vscode/test:
+//   gcc -O2 -std=gnu11 -Istub -I../../Core/Inc dict_test.c -o dict_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dict.h"
+
+#define LOOKUPS    (1 << 22)
+#define KEYS_MAX   4096
+#define STRESS_OPS 2000000
+
+static dict_declare(d32, 32);
+static dict_declare(d512, 512);
+static dict_declare(d2048, 2048);
+
+static uint32_t keys[KEYS_MAX];
+
+static uint32_t key_random(void)
+{
+    uint32_t key;
+    do {
+        key = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    } while (key == DICT_KEY_EMPTY);
+    return key;
+}
+
+static double ms_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Прежний dict: записи подряд, поиск перебором
+static uint32_t linear_get_idx(const struct keyvalue *kvs, uint32_t count, uint32_t key)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (kvs[i].key == key) {
+            return i;
+        }
+    }
+    return -1U;
+}
+
+static void bench(struct dict *d, uint32_t count)
+{
+    static struct keyvalue kvs[KEYS_MAX];
+    dict_clear(d);
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i] = key_random();
+        dict_add(d, keys[i], i);
+        kvs[i] = (struct keyvalue){.key = keys[i], .value = i};
+    }
+    // Половина запросов - отсутствующие uid, как чужие ответы на шине
+    volatile uint32_t sink = 0;
+    double t0 = ms_now();
+    for (uint32_t n = 0; n < LOOKUPS; n++) {
+        uint32_t key = (n & 1) ? keys[n % count] : keys[n % count] + 1;
+        sink += dict_get_idx(d, key);
+    }
+    double t1 = ms_now();
+    uint32_t lookups = LOOKUPS / count * 16;
+    for (uint32_t n = 0; n < lookups; n++) {
+        uint32_t key = (n & 1) ? keys[n % count] : keys[n % count] + 1;
+        sink += linear_get_idx(kvs, count, key);
+    }
+    double t2 = ms_now();
+    (void)sink;
+    printf("%5u entries: hash %6.1f ns, linear %8.1f ns per lookup\n", count,
+           (t1 - t0) * 1e6 / LOOKUPS, (t2 - t1) * 1e6 / lookups);
+}
+
+// Таблица заполняется до предела и опустошается вперемешку; после
+// каждого удаления со сдвигом все оставшиеся ключи должны находиться
+static uint32_t stress(struct dict *d)
+{
+    static uint32_t values[KEYS_MAX];
+    uint32_t count = 0;
+    uint32_t errors = 0;
+    dict_clear(d);
+    for (uint32_t n = 0; n < STRESS_OPS; n++) {
+        uint32_t is_add = (count == 0) || (!dict_is_full(d) && (rand() % 3 != 0));
+        if (is_add) {
+            uint32_t key = key_random() & 0xFFFF;
+            if ((key == DICT_KEY_EMPTY) || (dict_get_idx(d, key) != -1U)) {
+                continue;
+            }
+            errors += (dict_add(d, key, n) == -1U);
+            keys[count] = key;
+            values[count++] = n;
+        } else {
+            uint32_t i = rand() % count;
+            dict_del(d, keys[i]);
+            errors += (dict_get_idx(d, keys[i]) != -1U);
+            keys[i] = keys[--count];
+            values[i] = values[count];
+        }
+        if ((n % 1024 == 0) || (count == 0) || dict_is_full(d)) {
+            errors += (d->count != count);
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t idx = dict_get_idx(d, keys[i]);
+                errors += (idx == -1U) || (d->kvs[idx].value != values[i]);
+            }
+        }
+    }
+    // Заполненная таблица отказывает в новом ключе
+    while (!dict_is_full(d)) {
+        uint32_t key = key_random();
+        if (dict_get_idx(d, key) == -1U) {
+            dict_add(d, key, 0);
+        }
+    }
+    errors += (dict_add(d, DICT_KEY_EMPTY, 0) != -1U);
+    uint32_t key;
+    do {
+        key = key_random();
+    } while (dict_get_idx(d, key) != -1U);
+    errors += (dict_add(d, key, 0) != -1U);
+    printf("stress %4u cells: %u errors\n", d->mask + 1, errors);
+    return errors;
+}
+
+int main(void)
+{
+    srand(1);
+    bench((struct dict *)d32_buf, 16);
+    bench((struct dict *)d512_buf, 256);
+    bench((struct dict *)d2048_buf, 1024);
+    uint32_t errors = stress((struct dict *)d32_buf);
+    errors += stress((struct dict *)d512_buf);
+    errors += stress((struct dict *)d2048_buf);
+    printf("%s\n", errors ? "FAIL" : "OK");
+    return errors != 0;
+}
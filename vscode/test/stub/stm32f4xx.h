@@ -0,0 +1,68 @@
+#ifndef __STM32F4xx_H
+#define __STM32F4xx_H
+
+// Замена заголовка устройства для сборки модулей на ПК: только то,
+// что используют crc16.c, dict.h и разбор посылок в aura.c
+
+#include <stdint.h>
+#include <string.h>
+
+typedef int IRQn_Type;
+
+typedef struct {
+    uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef struct {
+    uint32_t CNT;
+} TIM_TypeDef;
+
+typedef struct {
+    uint32_t SR;
+} USART_TypeDef;
+
+typedef struct {
+    uint32_t LISR;
+} DMA_TypeDef;
+
+#define __PACKED       __attribute__((packed))
+#define __ALIGNED(x)   __attribute__((aligned(x)))
+#define __WEAK         __attribute__((weak))
+#define __STATIC_INLINE static inline
+
+#define __UNALIGNED_UINT32_READ(_addr) \
+    ({ uint32_t _v; memcpy(&_v, (const void *)(_addr), sizeof(_v)); _v; })
+
+static inline uint32_t __CLZ(uint32_t x)
+{
+    return (x == 0) ? 32 : (uint32_t)__builtin_clz(x);
+}
+
+static inline uint32_t __RBIT(uint32_t x)
+{
+    uint32_t r = 0;
+    for (uint32_t i = 0; i < 32; i++) {
+        r = (r << 1) | ((x >> i) & 1);
+    }
+    return r;
+}
+
+static inline void __disable_irq(void)
+{
+}
+
+static inline void __enable_irq(void)
+{
+}
+
+static inline uint32_t __get_PRIMASK(void)
+{
+    return 0;
+}
+
+static inline void __set_PRIMASK(uint32_t primask)
+{
+    (void)primask;
+}
+
+#endif
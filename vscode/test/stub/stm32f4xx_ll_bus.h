@@ -0,0 +1,7 @@
+#ifndef __STM32F4xx_LL_BUS_H
+#define __STM32F4xx_LL_BUS_H
+
+// Для сборки на ПК содержимое не нужно
+#include "stm32f4xx.h"
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef __STM32F4xx_LL_EXTI_H
+#define __STM32F4xx_LL_EXTI_H
+
+// Для сборки на ПК содержимое не нужно
+#include "stm32f4xx.h"
+
+#endif
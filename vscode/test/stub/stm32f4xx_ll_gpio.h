@@ -0,0 +1,43 @@
+#ifndef __STM32F4xx_LL_GPIO_H
+#define __STM32F4xx_LL_GPIO_H
+
+#include "stm32f4xx.h"
+
+#define LL_GPIO_PIN_0  (1U << 0)
+#define LL_GPIO_PIN_1  (1U << 1)
+#define LL_GPIO_PIN_4  (1U << 4)
+#define LL_GPIO_PIN_5  (1U << 5)
+#define LL_GPIO_PIN_6  (1U << 6)
+#define LL_GPIO_PIN_7  (1U << 7)
+#define LL_GPIO_PIN_8  (1U << 8)
+#define LL_GPIO_PIN_9  (1U << 9)
+#define LL_GPIO_PIN_10 (1U << 10)
+#define LL_GPIO_PIN_11 (1U << 11)
+#define LL_GPIO_PIN_12 (1U << 12)
+
+static GPIO_TypeDef gpio_c;
+static GPIO_TypeDef gpio_d;
+#define GPIOC (&gpio_c)
+#define GPIOD (&gpio_d)
+
+static inline uint32_t LL_GPIO_IsOutputPinSet(GPIO_TypeDef *port, uint32_t pin)
+{
+    return (port->ODR & pin) != 0;
+}
+
+static inline void LL_GPIO_SetOutputPin(GPIO_TypeDef *port, uint32_t pin)
+{
+    port->ODR |= pin;
+}
+
+static inline void LL_GPIO_ResetOutputPin(GPIO_TypeDef *port, uint32_t pin)
+{
+    port->ODR &= ~pin;
+}
+
+static inline void LL_GPIO_TogglePin(GPIO_TypeDef *port, uint32_t pin)
+{
+    port->ODR ^= pin;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __STM32F4xx_LL_TIM_H
+#define __STM32F4xx_LL_TIM_H
+
+#include "stm32f4xx.h"
+
+static TIM_TypeDef tim7;
+#define TIM7 (&tim7)
+
+static inline void LL_TIM_SetCounter(TIM_TypeDef *tim, uint32_t counter)
+{
+    tim->CNT = counter;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __STM32F4xx_LL_UTILS_H
+#define __STM32F4xx_LL_UTILS_H
+
+#include "stm32f4xx.h"
+
+static inline void LL_mDelay(uint32_t ms)
+{
+    (void)ms;
+}
+
+#endif